@@ -31,11 +31,22 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <float.h>
 
 #include "py/runtime.h"
 #include "py/binary.h"
 #include "py/objstr.h"
 #include "py/objint.h"
+#include "py/objarray.h"
+#include "py/mperrno.h"
+
+#ifndef MICROPY_PY_UCBOR_CANONICAL
+#define MICROPY_PY_UCBOR_CANONICAL (0)
+#endif
+
+// Additional information for indefinite lengths and the byte closing them
+#define CBOR_AI_INDEFINITE (31)
+#define CBOR_BREAK (0xff)
 
 #define VSTR_INIT(vstr, alloc) \
     vstr_t vstr;               \
@@ -46,476 +57,2261 @@
     mp_obj_t *array_items;   \
     mp_obj_get_array(array_obj, &array_len, &array_items);
 
-static mpz_t *mp_mpz_for_int(mp_obj_t arg, mpz_t *temp)
-{
-    if (MP_OBJ_IS_SMALL_INT(arg))
-    {
-        mpz_init_from_int(temp, MP_OBJ_SMALL_INT_VALUE(arg));
-        return temp;
-    }
-    else
-    {
-        mp_obj_int_t *arp_p = MP_OBJ_TO_PTR(arg);
-        return &(arp_p->mpz);
-    }
-}
-
-static mp_obj_t int_bit_length(mp_obj_t x)
+// Number of significant bits of an mpz magnitude, taken from its digit count
+// so the cost doesn't depend on the size of the value.
+static size_t cbor_mpz_bit_length(const mpz_t *z)
 {
-    mpz_t n_temp;
-    mpz_t *n = mp_mpz_for_int(x, &n_temp);
-    if (mpz_is_zero(n))
+    if (z->len == 0)
     {
-        return mp_obj_new_int_from_uint(0);
+        return 0;
     }
-    mpz_t *dest = m_new_obj(mpz_t);
-    dest->neg = n->neg;
-    dest->fixed_dig = 0;
-    dest->alloc = n->alloc;
-    dest->len = n->len;
-    dest->dig = m_new(mpz_dig_t, n->alloc);
-    memcpy(dest->dig, n->dig, n->alloc * sizeof(mpz_dig_t));
-    mpz_abs_inpl(dest, dest);
-    mp_uint_t num_bits = 0;
-    while (dest->len > 0)
+    size_t num_bits = (z->len - 1) * MPZ_DIG_SIZE;
+    for (mpz_dig_t d = z->dig[z->len - 1]; d != 0; d >>= 1)
     {
-        mpz_shr_inpl(dest, dest, 1);
         num_bits++;
     }
-    if (dest != NULL)
-    {
-        m_del(mpz_dig_t, dest->dig, dest->alloc);
-        m_del_obj(mpz_t, dest);
-    }
-    if (n == &n_temp)
-    {
-        mpz_deinit(n);
-    }
-    return mp_obj_new_int_from_ull(num_bits);
+    return num_bits;
 }
 
-typedef mp_obj_t (*mp_cbor_load_function_t)(const byte _ai, vstr_t *_data_vstr);
+typedef struct _mp_cbor_reader_t
+{
+    const byte *cur;
+    const byte *end;
+    mp_obj_t stream_readinto[3];
+    byte *buf;
+    size_t alloc;
+    // fill the whole buffer on every read, for readers that own the stream
+    bool read_ahead;
+    mp_obj_t tag_hook;
+    // caller object the input lives in and its buffer start, tag_hook may
+    // resize it so the buffer is fetched again after every call
+    mp_obj_t source;
+    const byte *base;
+} mp_cbor_reader_t;
+
+typedef mp_obj_t (*mp_cbor_load_function_t)(const byte _ai, mp_cbor_reader_t *_reader);
 typedef struct _mp_cbor_load_func_t
 {
     const byte _type;
     mp_cbor_load_function_t _func;
 } mp_cbor_load_func_t;
 
-typedef void (*mp_cbor_dump_function_t)(mp_obj_t _obj_data, vstr_t *_data_vstr);
+typedef struct _mp_cbor_writer_t
+{
+    byte *buf;
+    size_t len;
+    size_t alloc;
+    vstr_t *vstr;
+    mp_obj_t stream_write[3];
+    size_t written;
+    bool count_only;
+    bool canonical;
+    bool deterministic;
+    mp_obj_t default_func;
+    // caller object written into at 'offset', default= may resize it so
+    // the buffer is fetched again after every call
+    mp_obj_t target;
+    size_t offset;
+} mp_cbor_writer_t;
+
+typedef void (*mp_cbor_dump_function_t)(mp_obj_t _obj_data, mp_cbor_writer_t *_writer);
 typedef struct _mp_cbor_dump_func_t
 {
     const mp_obj_type_t *_type;
     mp_cbor_dump_function_t _func;
 } mp_cbor_dump_func_t;
 
-static void cbor_dump_buffer(mp_obj_t obj_data, vstr_t *data_vstr);
-static mp_obj_t cbor_dumps(mp_obj_t obj_data, vstr_t *data_vstr);
-static mp_obj_t cbor_loads(vstr_t *data_vstr);
+static void cbor_dumps(mp_obj_t obj_data, mp_cbor_writer_t *writer);
+static mp_obj_t cbor_loads(mp_cbor_reader_t *reader);
 
-static mp_obj_t cbor_load_int(const byte ai, vstr_t *data_vstr)
+static void cbor_writer_init_vstr(mp_cbor_writer_t *writer, vstr_t *vstr)
 {
-    mp_obj_t val = mp_const_none;
-
-    if (ai < 24)
-    {
-        val = mp_obj_new_int(ai);
-    }
-    else if (ai >= 24 && ai <= 27)
-    {
-        uint8_t n_bytes = (1 << (ai - 24));
-        val = mp_obj_int_from_bytes_impl(true, n_bytes, (const byte *)data_vstr->buf);
-        vstr_cut_head_bytes(data_vstr, n_bytes);
-    }
-
-    if (!mp_obj_is_int(val))
-    {
-        mp_raise_ValueError(MP_ERROR_TEXT("Invalid additional information"));
-    }
-
-    return val;
+    writer->buf = (byte *)vstr->buf;
+    writer->len = vstr->len;
+    writer->alloc = vstr->alloc;
+    writer->vstr = vstr;
+    writer->stream_write[0] = MP_OBJ_NULL;
+    writer->written = 0;
+    writer->count_only = false;
+    writer->canonical = false;
+    writer->deterministic = false;
+    writer->default_func = mp_const_none;
+    writer->target = MP_OBJ_NULL;
+    writer->offset = 0;
 }
 
-#define LOAD_INT(ai, data_vstr) \
-    size_t loaded_int = mp_obj_get_int(cbor_load_int(ai, data_vstr));
-
-static mp_obj_t cbor_load_uint(const byte ai, vstr_t *data_vstr)
+static void cbor_writer_init_fixed(mp_cbor_writer_t *writer, byte *buf, size_t alloc)
 {
-    return mp_binary_op(MP_BINARY_OP_SUBTRACT, mp_obj_new_int(-1), cbor_load_int(ai, data_vstr));
+    writer->buf = buf;
+    writer->len = 0;
+    writer->alloc = alloc;
+    writer->vstr = NULL;
+    writer->stream_write[0] = MP_OBJ_NULL;
+    writer->written = 0;
+    writer->count_only = false;
+    writer->canonical = false;
+    writer->deterministic = false;
+    writer->default_func = mp_const_none;
+    writer->target = MP_OBJ_NULL;
+    writer->offset = 0;
 }
 
-static mp_obj_t cbor_load_bytes(const byte ai, vstr_t *data_vstr)
+// Counting writer: output goes to a small scratch buffer that is discarded
+// whenever it fills, only the number of bytes is kept.
+static void cbor_writer_init_count(mp_cbor_writer_t *writer, byte *scratch, size_t alloc)
 {
-    LOAD_INT(ai, data_vstr);
-    mp_obj_t val = mp_obj_new_bytes((const byte *)data_vstr->buf, loaded_int);
-    vstr_cut_head_bytes(data_vstr, loaded_int);
-    return val;
+    cbor_writer_init_fixed(writer, scratch, alloc);
+    writer->count_only = true;
 }
 
-static mp_obj_t cbor_load_text(const byte ai, vstr_t *data_vstr)
+static void cbor_writer_init_stream(mp_cbor_writer_t *writer, mp_obj_t stream, size_t chunk)
 {
-    LOAD_INT(ai, data_vstr);
-    mp_obj_t val = mp_obj_new_str(data_vstr->buf, loaded_int);
-    vstr_cut_head_bytes(data_vstr, loaded_int);
-    return val;
+    mp_load_method(stream, MP_QSTR_write, writer->stream_write);
+    writer->buf = m_new(byte, chunk);
+    writer->len = 0;
+    writer->alloc = chunk;
+    writer->vstr = NULL;
+    writer->written = 0;
+    writer->count_only = false;
+    writer->canonical = false;
+    writer->deterministic = false;
+    writer->default_func = mp_const_none;
+    writer->target = MP_OBJ_NULL;
+    writer->offset = 0;
 }
 
-static mp_obj_t cbor_load_list(const byte ai, vstr_t *data_vstr)
+// Re-point the writer after Python code ran, the target may have moved
+static void cbor_writer_refetch(mp_cbor_writer_t *writer)
 {
-    LOAD_INT(ai, data_vstr);
-    mp_obj_t items = mp_obj_new_list(0, NULL);
-    for (size_t i = 0; i < loaded_int; i++)
+    if (writer->target == MP_OBJ_NULL)
     {
-        mp_obj_t item = cbor_loads(data_vstr);
-        mp_obj_list_append(items, item);
+        return;
     }
-    return items;
+    mp_buffer_info_t bufinfo;
+    mp_get_buffer_raise(writer->target, &bufinfo, MP_BUFFER_WRITE);
+    if (bufinfo.len < writer->offset + writer->len)
+    {
+        mp_raise_ValueError(MP_ERROR_TEXT("Buffer changed during encoding"));
+    }
+    writer->buf = (byte *)bufinfo.buf + writer->offset;
+    writer->alloc = bufinfo.len - writer->offset;
 }
 
-static mp_obj_t cbor_load_dict(const byte ai, vstr_t *data_vstr)
+// One write call on the stream, returns the number of bytes it took
+static size_t cbor_writer_stream_write_once(mp_cbor_writer_t *writer, const byte *buf, size_t len)
 {
-    LOAD_INT(ai, data_vstr);
-    mp_obj_t dict = mp_obj_new_dict(0);
-    for (size_t i = 0; i < loaded_int; i++)
+    writer->stream_write[2] = mp_obj_new_bytearray_by_ref(len, (void *)buf);
+    mp_obj_t ret = mp_call_method_n_kw(1, 0, writer->stream_write);
+    if (ret == mp_const_none)
     {
-        mp_obj_t key = cbor_loads(data_vstr);
-        mp_obj_t value = cbor_loads(data_vstr);
-        mp_obj_dict_store(dict, key, value);
+        // a non-blocking stream that could not take anything
+        mp_raise_OSError(MP_EAGAIN);
     }
-    return dict;
+    mp_int_t out_sz = mp_obj_get_int(ret);
+    if (out_sz <= 0 || (size_t)out_sz > len)
+    {
+        mp_raise_OSError(MP_EIO);
+    }
+    writer->written += out_sz;
+    return out_sz;
 }
 
-static mp_obj_t cbor_unsupported_major_type(const byte ai, vstr_t *data_vstr)
+static void cbor_writer_stream_write(mp_cbor_writer_t *writer, const byte *buf, size_t len)
 {
-    nlr_raise(mp_obj_new_exception_msg_varg(&mp_type_ValueError, MP_ERROR_TEXT("Unsupported major type: %d"), (ai >> 5)));
+    while (len > 0)
+    {
+        size_t n = cbor_writer_stream_write_once(writer, buf, len);
+        buf += n;
+        len -= n;
+    }
 }
 
-#if MICROPY_PY_BUILTINS_FLOAT
-static mp_obj_t cbor_load_half_float(const byte ai, vstr_t *data_vstr)
+static void cbor_writer_flush(mp_cbor_writer_t *writer)
 {
-    if (data_vstr->len < sizeof(uint16_t))
+    while (writer->len > 0)
     {
-        mp_raise_ValueError(MP_ERROR_TEXT("Buffer to small"));
+        // drop what was sent right away, so a write that raises part way
+        // leaves only the unsent bytes for the next flush
+        size_t n = cbor_writer_stream_write_once(writer, writer->buf, writer->len);
+        writer->len -= n;
+        memmove(writer->buf, writer->buf + n, writer->len);
     }
+}
 
-    union
-    {
-        uint8_t i8[8];
-        uint16_t i16[4];
-        uint32_t i32[2];
-        uint64_t i64[1];
-        double f;
-    } fp_dp;
-
-    uint16_t u16 = ((uint8_t)data_vstr->buf[0] << 8) + (uint8_t)data_vstr->buf[1];
-    int16_t exp = (int16_t)((u16 >> 10) & 0x1fU) - 15;
-
-    /* Reconstruct IEEE double into little endian order first, then convert
-     * to host order.
-     */
-
-    memset((void *)&fp_dp, 0, sizeof(fp_dp));
-
-    if (exp == -15)
+static void cbor_writer_grow(mp_cbor_writer_t *writer, size_t n)
+{
+    if (writer->stream_write[0] != MP_OBJ_NULL || writer->count_only)
     {
-        /* Zero or denormal; but note that half float
-         * denormals become double normals.
-         */
-        if ((u16 & 0x03ffU) == 0)
+        if (writer->count_only)
         {
-            fp_dp.i8[7] = data_vstr->buf[0] & 0x80U;
+            writer->written += writer->len;
+            writer->len = 0;
         }
         else
         {
-            /* Create denormal by first creating a double that
-             * contains the denormal bits and a leading implicit
-             * 1-bit.  Then subtract away the implicit 1-bit.
-             *
-             *    0.mmmmmmmmmm * 2^-14
-             *    1.mmmmmmmmmm 0.... * 2^-14
-             *   -1.0000000000 0.... * 2^-14
-             *
-             * Double exponent: -14 + 1023 = 0x3f1
-             */
-            fp_dp.i8[7] = 0x3fU;
-            fp_dp.i8[6] = 0x10U + (uint8_t)((u16 >> 6) & 0x0fU);
-            fp_dp.i8[5] = (uint8_t)((u16 << 2) & 0xffU); /* Mask is really 0xfcU */
-
-            fp_dp.f = fp_dp.f - (double)0.00006103515625; /* 2^(-14) */
-            if (u16 & 0x8000U)
-            {
-                fp_dp.f = -fp_dp.f;
-            }
-            vstr_cut_head_bytes(data_vstr, sizeof(uint16_t));
-            return mp_obj_new_float((mp_float_t)fp_dp.f);
-        }
-    }
-    else if (exp == 16)
-    {
-        /* +/- Inf or NaN. */
-        if ((u16 & 0x03ffU) == 0)
-        {
-            fp_dp.i8[7] = (data_vstr->buf[0] & 0x80U) + 0x7fU;
-            fp_dp.i8[6] = 0xf0U;
+            cbor_writer_flush(writer);
         }
-        else
+        if (n > writer->alloc)
         {
-            /* Create a 'quiet NaN' with highest
-             * bit set (there are some platforms
-             * where the NaN payload convention is
-             * the opposite).  Keep sign.
-             */
-            fp_dp.i8[7] = (data_vstr->buf[0] & 0x80U) + 0x7fU;
-            fp_dp.i8[6] = 0xf8U;
+            // a single piece larger than the chunk, e.g. a big integer
+            writer->buf = m_new(byte, n);
+            writer->alloc = n;
         }
+        return;
     }
-    else
+    if (writer->vstr == NULL)
     {
-        /* Normal. */
-        uint32_t tmp = 0;
-        tmp = (data_vstr->buf[0] & 0x80U) ? 0x80000000UL : 0UL;
-        tmp += (uint32_t)(exp + 1023) << 20;
-        tmp += (uint32_t)(data_vstr->buf[0] & 0x03U) << 18;
-        tmp += (uint32_t)(data_vstr->buf[1] & 0xffU) << 10;
-        fp_dp.i8[7] = (tmp >> 24) & 0xffU;
-        fp_dp.i8[6] = (tmp >> 16) & 0xffU;
-        fp_dp.i8[5] = (tmp >> 8) & 0xffU;
-        fp_dp.i8[4] = (tmp >> 0) & 0xffU;
+        mp_raise_ValueError(MP_ERROR_TEXT("Buffer to small"));
     }
-
-    vstr_cut_head_bytes(data_vstr, sizeof(uint16_t));
-    return mp_obj_new_float((mp_float_t)fp_dp.f);
+    // grow geometrically, vstr_extend only adds exactly what it is asked for
+    vstr_extend(writer->vstr, MAX(n, writer->alloc));
+    writer->buf = (byte *)writer->vstr->buf;
+    writer->alloc = writer->vstr->alloc;
 }
 
-static mp_obj_t cbor_load_float(const byte ai, vstr_t *data_vstr)
+static byte *cbor_writer_add_len(mp_cbor_writer_t *writer, size_t n)
 {
-    if (data_vstr->len < sizeof(uint32_t))
+    if (writer->alloc - writer->len < n)
     {
-        mp_raise_ValueError(MP_ERROR_TEXT("Buffer to small"));
+        cbor_writer_grow(writer, n);
     }
+    byte *p = writer->buf + writer->len;
+    writer->len += n;
+    return p;
+}
 
-    union
-    {
-        uint8_t i8[4];
-        uint16_t i16[2];
-        uint32_t i32[1];
-        float f;
-    } fp_sp;
+static void cbor_writer_add_byte(mp_cbor_writer_t *writer, byte b)
+{
+    *cbor_writer_add_len(writer, 1) = b;
+}
 
-    memset((void *)&fp_sp, 0, sizeof(fp_sp));
-    // memcpy((void *)&fp_dp.i8, (const void *)data_vstr->buf, sizeof(uint32_t));
+static void cbor_writer_add_strn(mp_cbor_writer_t *writer, const byte *str, size_t n)
+{
+    if (writer->count_only)
+    {
+        writer->written += n;
+        return;
+    }
+    if (writer->stream_write[0] != MP_OBJ_NULL && writer->alloc - writer->len < n)
+    {
+        // hand large payloads straight to the stream instead of chunking them
+        cbor_writer_flush(writer);
+        if (n > writer->alloc)
+        {
+            cbor_writer_stream_write(writer, str, n);
+            return;
+        }
+    }
+    memcpy(cbor_writer_add_len(writer, n), str, n);
+}
 
-    long long val = mp_binary_get_int(sizeof(uint32_t), true, 1, (const byte *)data_vstr->buf);
-    fp_sp.i32[0] = val;
+static mp_obj_t cbor_writer_finish_bytes(mp_cbor_writer_t *writer)
+{
+    writer->vstr->len = writer->len;
+    return mp_obj_new_bytes_from_vstr(writer->vstr);
+}
 
-    vstr_cut_head_bytes(data_vstr, sizeof(uint32_t));
-    return mp_obj_new_float((mp_float_t)fp_sp.f);
+static void cbor_reader_init_buffer(mp_cbor_reader_t *reader, const byte *buf, size_t len)
+{
+    reader->cur = buf;
+    reader->end = buf + len;
+    reader->stream_readinto[0] = MP_OBJ_NULL;
+    reader->buf = NULL;
+    reader->alloc = 0;
+    reader->read_ahead = false;
+    reader->tag_hook = mp_const_none;
+    reader->source = MP_OBJ_NULL;
+    reader->base = buf;
 }
 
-static mp_obj_t cbor_load_double(const byte ai, vstr_t *data_vstr)
+// Read the buffer of 'source' from 'offset' on
+static void cbor_reader_init_source(mp_cbor_reader_t *reader, mp_obj_t source, size_t offset)
 {
-    if (data_vstr->len < sizeof(uint64_t))
+    mp_buffer_info_t bufinfo;
+    mp_get_buffer_raise(source, &bufinfo, MP_BUFFER_READ);
+    if (offset > bufinfo.len)
     {
         mp_raise_ValueError(MP_ERROR_TEXT("Buffer to small"));
     }
+    cbor_reader_init_buffer(reader, (const byte *)bufinfo.buf + offset, bufinfo.len - offset);
+    reader->source = source;
+    reader->base = (const byte *)bufinfo.buf;
+}
 
-    union
+// Re-point the reader after Python code ran, the source may have moved
+static void cbor_reader_refetch(mp_cbor_reader_t *reader)
+{
+    if (reader->source == MP_OBJ_NULL)
     {
-        uint8_t i8[8];
-        uint16_t i16[4];
-        uint32_t i32[2];
-        uint64_t i64[1];
-        double f;
-    } fp_dp;
-
-    memset((void *)&fp_dp, 0, sizeof(fp_dp));
-    long long val = mp_binary_get_int(sizeof(uint64_t), true, 1, (const byte *)data_vstr->buf);
-    fp_dp.i64[0] = val;
+        return;
+    }
+    mp_buffer_info_t bufinfo;
+    mp_get_buffer_raise(reader->source, &bufinfo, MP_BUFFER_READ);
+    size_t cur = reader->cur - reader->base;
+    size_t end = reader->end - reader->base;
+    if (end > bufinfo.len)
+    {
+        mp_raise_ValueError(MP_ERROR_TEXT("Buffer changed during decoding"));
+    }
+    reader->base = (const byte *)bufinfo.buf;
+    reader->cur = reader->base + cur;
+    reader->end = reader->base + end;
+}
 
-    vstr_cut_head_bytes(data_vstr, sizeof(uint64_t));
-    return mp_obj_new_float((mp_float_t)fp_dp.f);
+static void cbor_reader_init_stream(mp_cbor_reader_t *reader, mp_obj_t stream, size_t alloc)
+{
+    mp_load_method(stream, MP_QSTR_readinto, reader->stream_readinto);
+    reader->buf = m_new(byte, alloc);
+    reader->alloc = alloc;
+    reader->cur = reader->buf;
+    reader->end = reader->buf;
+    reader->read_ahead = false;
+    // a single bytearray is re-pointed at the refill area for every readinto call
+    reader->stream_readinto[2] = mp_obj_new_bytearray_by_ref(0, reader->buf);
+    reader->tag_hook = mp_const_none;
+    reader->source = MP_OBJ_NULL;
+    reader->base = reader->buf;
 }
-#endif
 
-static mp_obj_t cbor_load_special(const byte ai, vstr_t *data_vstr)
+static void cbor_reader_deinit(mp_cbor_reader_t *reader)
 {
-    switch (ai)
+    if (reader->buf != NULL)
     {
-    case 20:
-    {
-        return mp_const_false;
+        m_del(byte, reader->buf, reader->alloc);
+        reader->buf = NULL;
     }
-    case 21:
+}
+
+// One readinto call on the stream, returns the number of bytes read
+static mp_int_t cbor_reader_readinto(mp_cbor_reader_t *reader, byte *dest, size_t n)
+{
+    mp_obj_array_t *view = MP_OBJ_TO_PTR(reader->stream_readinto[2]);
+    view->items = dest;
+    view->len = n;
+    mp_obj_t ret = mp_call_method_n_kw(1, 0, reader->stream_readinto);
+    if (ret == mp_const_none)
     {
-        return mp_const_true;
+        mp_raise_OSError(MP_EAGAIN);
     }
-    case 22:
-    case 23:
+    mp_int_t in_sz = mp_obj_get_int(ret);
+    if (in_sz > (mp_int_t)n)
     {
-        return mp_const_none;
+        mp_raise_OSError(MP_EIO);
     }
-    case 24:
+    return in_sz;
+}
+
+static void cbor_reader_fill(mp_cbor_reader_t *reader, size_t n)
+{
+    if (reader->stream_readinto[0] == MP_OBJ_NULL)
     {
-        break;
+        mp_raise_ValueError(MP_ERROR_TEXT("Buffer to small"));
     }
-    case 25:
+
+    size_t avail = reader->end - reader->cur;
+    memmove(reader->buf, reader->cur, avail);
+    if (n > reader->alloc)
     {
-/* half-float (2 bytes) */
-#if MICROPY_PY_BUILTINS_FLOAT
-        return cbor_load_half_float(ai, data_vstr);
-#else
-        break;
-#endif
+        reader->buf = m_renew(byte, reader->buf, reader->alloc, n);
+        reader->alloc = n;
     }
-    case 26:
+    reader->cur = reader->buf;
+    reader->end = reader->buf + avail;
+
+    // unless reading ahead, only read what the current item needs so the
+    // stream is never consumed past the end of the document
+    while (avail < n)
     {
-/* float (4 bytes) */
-#if MICROPY_PY_BUILTINS_FLOAT
-        return cbor_load_float(ai, data_vstr);
-#else
-        break;
-#endif
+        size_t want = reader->read_ahead ? reader->alloc - avail : n - avail;
+        mp_int_t in_sz = cbor_reader_readinto(reader, reader->buf + avail, want);
+        if (in_sz <= 0)
+        {
+            mp_raise_type(&mp_type_EOFError);
+        }
+        avail += in_sz;
+        reader->end += in_sz;
     }
-    case 27:
+}
+
+// True when no input is left, only meant to be called between items
+static bool cbor_reader_at_end(mp_cbor_reader_t *reader)
+{
+    if (reader->cur < reader->end)
     {
-/* double (8 bytes) */
-#if MICROPY_PY_BUILTINS_FLOAT
-        return cbor_load_double(ai, data_vstr);
-#else
-        break;
-#endif
+        return false;
     }
-    default:
+    if (reader->stream_readinto[0] == MP_OBJ_NULL)
     {
-        break;
+        return true;
     }
-    }
-
-    nlr_raise(mp_obj_new_exception_msg_varg(&mp_type_ValueError, MP_ERROR_TEXT("Unsupported additional information: %d"), ai));
+    // the buffer is drained, so peek at the stream for the next item
+    mp_int_t in_sz = cbor_reader_readinto(reader, reader->buf, reader->read_ahead ? reader->alloc : 1);
+    reader->cur = reader->buf;
+    reader->end = reader->buf + MAX(in_sz, 0);
+    return in_sz <= 0;
 }
 
-static mp_cbor_load_func_t load_functions_map[] = {
-    {0, cbor_load_int},
-    {1, cbor_load_uint},
-    {2, cbor_load_bytes},
-    {3, cbor_load_text},
-    {4, cbor_load_list},
-    {5, cbor_load_dict},
-    {6, cbor_unsupported_major_type},
-    {7, cbor_load_special},
-};
-
-static mp_obj_t cbor_loads(vstr_t *data_vstr)
+static const byte *cbor_reader_take(mp_cbor_reader_t *reader, size_t n)
 {
-    byte fb = data_vstr->buf[0];
-    vstr_cut_head_bytes(data_vstr, 1);
-    byte mt = (fb >> 5);
-    byte ai = (fb & 0x1f);
-    if (mt > 7)
+    if ((size_t)(reader->end - reader->cur) < n)
     {
-        cbor_unsupported_major_type(ai, data_vstr);
+        cbor_reader_fill(reader, n);
     }
-    return load_functions_map[mt]._func(ai, data_vstr);
+    const byte *p = reader->cur;
+    reader->cur += n;
+    return p;
 }
 
-static mp_obj_t cbor_decode(mp_obj_t obj_data)
+static uint64_t cbor_read_uint_be(const byte *p, size_t n)
 {
-    VSTR_INIT(data_vstr, 16);
-    cbor_dump_buffer(obj_data, &data_vstr);
-    mp_obj_t val = cbor_loads(&data_vstr);
-    vstr_clear(&data_vstr);
+    uint64_t val = 0;
+    while (n--)
+    {
+        val = (val << 8) | *p++;
+    }
     return val;
 }
 
-static MP_DEFINE_CONST_FUN_OBJ_1(cbor_decode_obj, cbor_decode);
-
-#if defined(MICROPY_PY_UCBOR_CANONICAL)
-static mp_obj_t cbor_sort_key(mp_obj_t entry)
+static uint64_t cbor_load_head(const byte ai, mp_cbor_reader_t *reader)
 {
-    mp_obj_tuple_t *entry_tuple = MP_OBJ_TO_PTR(entry);
-    mp_obj_t key = entry_tuple->items[0];
-    mp_buffer_info_t bufinfo;
-    mp_get_buffer_raise(key, &bufinfo, MP_BUFFER_READ);
-    mp_obj_t sort_tuple[3] = {mp_obj_new_bytearray_by_ref(1, (byte *)bufinfo.buf), mp_obj_new_int(bufinfo.len), key};
-    return mp_obj_new_tuple(MP_ARRAY_SIZE(sort_tuple), sort_tuple);
+    if (ai < 24)
+    {
+        return ai;
+    }
+    else if (ai <= 27)
+    {
+        uint8_t n_bytes = (1 << (ai - 24));
+        return cbor_read_uint_be(cbor_reader_take(reader, n_bytes), n_bytes);
+    }
+    mp_raise_ValueError(MP_ERROR_TEXT("Invalid additional information"));
 }
 
-static MP_DEFINE_CONST_FUN_OBJ_1(cbor_sort_key_obj, cbor_sort_key);
-#endif
+static size_t cbor_load_size(const byte ai, mp_cbor_reader_t *reader)
+{
+    uint64_t val = cbor_load_head(ai, reader);
+    if (val > SIZE_MAX)
+    {
+        mp_raise_ValueError(MP_ERROR_TEXT("Length too large"));
+    }
+    return (size_t)val;
+}
 
-static void cbor_dump_int_with_major_type(mp_obj_t obj_data, vstr_t *data_vstr, mp_int_t mt)
+static mp_obj_t cbor_load_int(const byte ai, mp_cbor_reader_t *reader)
 {
-    if (MP_OBJ_IS_SMALL_INT(obj_data))
+    uint64_t val = cbor_load_head(ai, reader);
+    if (val <= (uint64_t)MP_SMALL_INT_MAX)
     {
-        mp_int_t data = mp_obj_get_int(obj_data);
-        if (data < 0)
-        {
-            mt = 1;
-            data = -1 - data;
-        }
+        return MP_OBJ_NEW_SMALL_INT(val);
+    }
+    return mp_obj_new_int_from_ull(val);
+}
 
-        mt = mt << 5;
-        if (data <= 23)
+#define LOAD_INT(ai, reader) \
+    size_t loaded_int = cbor_load_size(ai, reader);
+
+static mp_obj_t cbor_load_uint(const byte ai, mp_cbor_reader_t *reader)
+{
+    uint64_t val = cbor_load_head(ai, reader);
+    if (val <= (uint64_t)MP_SMALL_INT_MAX)
+    {
+        return MP_OBJ_NEW_SMALL_INT(-1 - (mp_int_t)val);
+    }
+    else if (val <= (uint64_t)INT64_MAX)
+    {
+        return mp_obj_new_int_from_ll(-1 - (long long)val);
+    }
+    // -1 - val doesn't fit in 64 bits, let mpz do ~val
+    return mp_unary_op(MP_UNARY_OP_INVERT, mp_obj_new_int_from_ull(val));
+}
+
+// Consume the break byte if it is next, true when an indefinite-length item ends
+static bool cbor_reader_break(mp_cbor_reader_t *reader)
+{
+    if (*cbor_reader_take(reader, 1) == CBOR_BREAK)
+    {
+        return true;
+    }
+    // the byte stays in the buffer, even after a stream refill
+    reader->cur--;
+    return false;
+}
+
+// Total payload of the chunks of an indefinite-length string starting at p,
+// stopping early on anything malformed that the decode pass will report
+static size_t cbor_chunks_size(const byte *p, const byte *end)
+{
+    size_t total = 0;
+    while (p < end && *p != CBOR_BREAK)
+    {
+        byte ai = *p++ & 0x1f;
+        uint64_t n_bytes = ai;
+        if (ai >= 24)
+        {
+            size_t head_len = 1 << (ai - 24);
+            if (ai > 27 || (size_t)(end - p) < head_len)
+            {
+                break;
+            }
+            n_bytes = cbor_read_uint_be(p, head_len);
+            p += head_len;
+        }
+        if (n_bytes > (uint64_t)(end - p))
+        {
+            break;
+        }
+        total += n_bytes;
+        p += n_bytes;
+    }
+    return total;
+}
+
+static mp_obj_t cbor_load_chunks(const byte mt, mp_cbor_reader_t *reader)
+{
+    // when the input is in memory the chunks are sized up front so the
+    // result is allocated once, streams grow it as chunks arrive
+    size_t total = 0;
+    if (reader->stream_readinto[0] == MP_OBJ_NULL)
+    {
+        total = cbor_chunks_size(reader->cur, reader->end);
+    }
+    VSTR_INIT(vstr, total + 1);
+    while (!cbor_reader_break(reader))
+    {
+        byte fb = *cbor_reader_take(reader, 1);
+        if ((fb >> 5) != mt)
+        {
+            mp_raise_ValueError(MP_ERROR_TEXT("Invalid chunk"));
+        }
+        size_t n_bytes = cbor_load_size(fb & 0x1f, reader);
+        vstr_add_strn(&vstr, (const char *)cbor_reader_take(reader, n_bytes), n_bytes);
+    }
+    return (mt == 2) ? mp_obj_new_bytes_from_vstr(&vstr) : mp_obj_new_str_from_vstr(&vstr);
+}
+
+static mp_obj_t cbor_load_bytes(const byte ai, mp_cbor_reader_t *reader)
+{
+    if (ai == CBOR_AI_INDEFINITE)
+    {
+        return cbor_load_chunks(2, reader);
+    }
+    LOAD_INT(ai, reader);
+    return mp_obj_new_bytes(cbor_reader_take(reader, loaded_int), loaded_int);
+}
+
+static mp_obj_t cbor_load_text(const byte ai, mp_cbor_reader_t *reader)
+{
+    if (ai == CBOR_AI_INDEFINITE)
+    {
+        return cbor_load_chunks(3, reader);
+    }
+    LOAD_INT(ai, reader);
+    return mp_obj_new_str((const char *)cbor_reader_take(reader, loaded_int), loaded_int);
+}
+
+static mp_obj_t cbor_load_list(const byte ai, mp_cbor_reader_t *reader)
+{
+    if (ai == CBOR_AI_INDEFINITE)
+    {
+        mp_obj_t items = mp_obj_new_list(0, NULL);
+        while (!cbor_reader_break(reader))
+        {
+            mp_obj_list_append(items, cbor_loads(reader));
+        }
+        return items;
+    }
+    LOAD_INT(ai, reader);
+    mp_obj_t items = mp_obj_new_list(0, NULL);
+    for (size_t i = 0; i < loaded_int; i++)
+    {
+        mp_obj_t item = cbor_loads(reader);
+        mp_obj_list_append(items, item);
+    }
+    return items;
+}
+
+static mp_obj_t cbor_load_dict(const byte ai, mp_cbor_reader_t *reader)
+{
+    if (ai == CBOR_AI_INDEFINITE)
+    {
+        mp_obj_t dict = mp_obj_new_dict(0);
+        while (!cbor_reader_break(reader))
+        {
+            mp_obj_t key = cbor_loads(reader);
+            mp_obj_t value = cbor_loads(reader);
+            mp_obj_dict_store(dict, key, value);
+        }
+        return dict;
+    }
+    LOAD_INT(ai, reader);
+    mp_obj_t dict = mp_obj_new_dict(0);
+    for (size_t i = 0; i < loaded_int; i++)
+    {
+        mp_obj_t key = cbor_loads(reader);
+        mp_obj_t value = cbor_loads(reader);
+        mp_obj_dict_store(dict, key, value);
+    }
+    return dict;
+}
+
+typedef struct _mp_obj_cbor_tag_t
+{
+    mp_obj_base_t base;
+    mp_obj_t tag;
+    mp_obj_t value;
+} mp_obj_cbor_tag_t;
+
+static mp_obj_t cbor_tag_make_new(const mp_obj_type_t *type, size_t n_args, size_t n_kw, const mp_obj_t *args)
+{
+    mp_arg_check_num(n_args, n_kw, 2, 2, false);
+    // tag numbers are unsigned 64-bit values
+    if (!mp_obj_is_int(args[0]) || mp_obj_int_sign(args[0]) < 0 ||
+        (!mp_obj_is_small_int(args[0]) && cbor_mpz_bit_length(&((mp_obj_int_t *)MP_OBJ_TO_PTR(args[0]))->mpz) > 64))
+    {
+        mp_raise_ValueError(MP_ERROR_TEXT("Invalid tag"));
+    }
+    mp_obj_cbor_tag_t *self = mp_obj_malloc(mp_obj_cbor_tag_t, type);
+    self->tag = args[0];
+    self->value = args[1];
+    return MP_OBJ_FROM_PTR(self);
+}
+
+static void cbor_tag_print(const mp_print_t *print, mp_obj_t self_in, mp_print_kind_t kind)
+{
+    mp_obj_cbor_tag_t *self = MP_OBJ_TO_PTR(self_in);
+    mp_print_str(print, "CBORTag(");
+    mp_obj_print_helper(print, self->tag, PRINT_REPR);
+    mp_print_str(print, ", ");
+    mp_obj_print_helper(print, self->value, PRINT_REPR);
+    mp_print_str(print, ")");
+}
+
+static void cbor_tag_attr(mp_obj_t self_in, qstr attr, mp_obj_t *dest)
+{
+    mp_obj_cbor_tag_t *self = MP_OBJ_TO_PTR(self_in);
+    if (dest[0] != MP_OBJ_NULL)
+    {
+        // read-only
+        return;
+    }
+    if (attr == MP_QSTR_tag)
+    {
+        dest[0] = self->tag;
+    }
+    else if (attr == MP_QSTR_value)
+    {
+        dest[0] = self->value;
+    }
+}
+
+static mp_obj_t cbor_tag_binary_op(mp_binary_op_t op, mp_obj_t lhs_in, mp_obj_t rhs_in)
+{
+    if (op != MP_BINARY_OP_EQUAL || mp_obj_get_type(rhs_in) != mp_obj_get_type(lhs_in))
+    {
+        return MP_OBJ_NULL; // op not supported
+    }
+    mp_obj_cbor_tag_t *lhs = MP_OBJ_TO_PTR(lhs_in);
+    mp_obj_cbor_tag_t *rhs = MP_OBJ_TO_PTR(rhs_in);
+    return mp_obj_new_bool(mp_obj_equal(lhs->tag, rhs->tag) && mp_obj_equal(lhs->value, rhs->value));
+}
+
+static MP_DEFINE_CONST_OBJ_TYPE(
+    cbor_tag_type,
+    MP_QSTR_CBORTag,
+    MP_TYPE_FLAG_NONE,
+    make_new, cbor_tag_make_new,
+    print, cbor_tag_print,
+    binary_op, cbor_tag_binary_op,
+    attr, cbor_tag_attr);
+
+static mp_obj_t cbor_tag_new(mp_obj_t tag, mp_obj_t value)
+{
+    mp_obj_cbor_tag_t *self = mp_obj_malloc(mp_obj_cbor_tag_t, &cbor_tag_type);
+    self->tag = tag;
+    self->value = value;
+    return MP_OBJ_FROM_PTR(self);
+}
+
+static mp_obj_t cbor_load_bignum(uint64_t tag, mp_cbor_reader_t *reader)
+{
+    // the content is the big-endian magnitude as a byte string
+    byte fb = *cbor_reader_take(reader, 1);
+    if ((fb >> 5) != 2)
+    {
+        mp_raise_ValueError(MP_ERROR_TEXT("Invalid bignum"));
+    }
+    size_t n_bytes = cbor_load_size(fb & 0x1f, reader);
+    mp_obj_t val = mp_obj_int_from_bytes_impl(true, n_bytes, cbor_reader_take(reader, n_bytes));
+    if (tag == 3)
+    {
+        val = mp_unary_op(MP_UNARY_OP_INVERT, val);
+    }
+    return val;
+}
+
+static mp_obj_t cbor_load_self_described(uint64_t tag, mp_cbor_reader_t *reader)
+{
+    // the self-described CBOR marker carries no meaning of its own
+    return cbor_loads(reader);
+}
+
+#if MICROPY_PY_ARRAY
+/* RFC 8746 typed array tags are 0b010fsell: f float, s signed,
+ * e little endian and ll the element size.
+ */
+#define CBOR_TYPED_ARRAY_FIRST (64)
+#define CBOR_TYPED_ARRAY_LAST (87)
+#define CBOR_TYPED_ARRAY_FLOAT (0x10)
+#define CBOR_TYPED_ARRAY_SIGNED (0x08)
+#define CBOR_TYPED_ARRAY_LITTLE (0x04)
+
+// array.array typecode holding the elements of a typed array tag, 0 if none does
+static char cbor_typed_array_typecode(uint64_t tag)
+{
+    size_t ll = tag & 0x03;
+    if (tag & CBOR_TYPED_ARRAY_FLOAT)
+    {
+#if MICROPY_PY_BUILTINS_FLOAT
+        // no typecode for binary16 and binary128
+        if (ll == 1 || ll == 2)
+        {
+            return (ll == 1) ? 'f' : 'd';
+        }
+#endif
+        return 0;
+    }
+    if (tag == (CBOR_TYPED_ARRAY_FIRST | CBOR_TYPED_ARRAY_SIGNED | CBOR_TYPED_ARRAY_LITTLE))
+    {
+        // reserved
+        return 0;
+    }
+    for (const char *typecode = (tag & CBOR_TYPED_ARRAY_SIGNED) ? "bhilq" : "BHILQ"; *typecode; typecode++)
+    {
+        if (mp_binary_get_size('@', *typecode, NULL) == ((size_t)1 << ll))
+        {
+            return *typecode;
+        }
+    }
+    return 0;
+}
+
+static mp_obj_t cbor_load_typed_array(uint64_t tag, mp_cbor_reader_t *reader)
+{
+    char typecode = cbor_typed_array_typecode(tag);
+    size_t size = mp_binary_get_size('@', typecode, NULL);
+    byte fb = *cbor_reader_take(reader, 1);
+    if ((fb >> 5) != 2)
+    {
+        mp_raise_ValueError(MP_ERROR_TEXT("Invalid typed array"));
+    }
+    size_t n_bytes = cbor_load_size(fb & 0x1f, reader);
+    if (n_bytes % size != 0)
+    {
+        mp_raise_ValueError(MP_ERROR_TEXT("Invalid typed array"));
+    }
+
+    // build the array.array around a single copy of the payload
+    mp_obj_array_t *array = m_new_obj(mp_obj_array_t);
+    array->base.type = &mp_type_array;
+    array->typecode = typecode;
+    array->free = 0;
+    array->len = n_bytes / size;
+    array->items = m_new(byte, n_bytes);
+    memcpy(array->items, cbor_reader_take(reader, n_bytes), n_bytes);
+
+    bool little = (tag & CBOR_TYPED_ARRAY_LITTLE) != 0;
+    if (size > 1 && little != MP_ENDIANNESS_LITTLE)
+    {
+        // foreign byte order, swap every element in place
+        for (byte *p = array->items; p < (byte *)array->items + n_bytes; p += size)
+        {
+            for (size_t i = 0; i < size / 2; i++)
+            {
+                byte t = p[i];
+                p[i] = p[size - 1 - i];
+                p[size - 1 - i] = t;
+            }
+        }
+    }
+    return MP_OBJ_FROM_PTR(array);
+}
+#endif
+
+typedef mp_obj_t (*mp_cbor_tag_function_t)(uint64_t _tag, mp_cbor_reader_t *_reader);
+typedef struct _mp_cbor_tag_func_t
+{
+    uint64_t _tag;
+    mp_cbor_tag_function_t _func;
+} mp_cbor_tag_func_t;
+
+// Tags decoded natively, these take precedence over tag_hook
+static const mp_cbor_tag_func_t tag_functions_map[] = {
+    {2, cbor_load_bignum},
+    {3, cbor_load_bignum},
+    {55799, cbor_load_self_described},
+};
+
+static mp_obj_t cbor_load_tag(const byte ai, mp_cbor_reader_t *reader)
+{
+    uint64_t tag = cbor_load_head(ai, reader);
+    for (size_t i = 0; i < MP_ARRAY_SIZE(tag_functions_map); i++)
+    {
+        if (tag_functions_map[i]._tag == tag)
+        {
+            return tag_functions_map[i]._func(tag, reader);
+        }
+    }
+#if MICROPY_PY_ARRAY
+    if (tag >= CBOR_TYPED_ARRAY_FIRST && tag <= CBOR_TYPED_ARRAY_LAST && cbor_typed_array_typecode(tag) != 0)
+    {
+        return cbor_load_typed_array(tag, reader);
+    }
+#endif
+
+    mp_obj_t tag_obj = mp_obj_new_int_from_ull(tag);
+    mp_obj_t value = cbor_loads(reader);
+    if (reader->tag_hook != mp_const_none)
+    {
+        mp_obj_t ret = mp_call_function_2(reader->tag_hook, tag_obj, value);
+        cbor_reader_refetch(reader);
+        return ret;
+    }
+    return cbor_tag_new(tag_obj, value);
+}
+
+static mp_obj_t cbor_unsupported_major_type(const byte ai, mp_cbor_reader_t *reader)
+{
+    nlr_raise(mp_obj_new_exception_msg_varg(&mp_type_ValueError, MP_ERROR_TEXT("Unsupported major type: %d"), (ai >> 5)));
+}
+
+#if MICROPY_PY_BUILTINS_FLOAT
+static mp_obj_t cbor_load_half_float(const byte ai, mp_cbor_reader_t *reader)
+{
+    const byte *buf = cbor_reader_take(reader, sizeof(uint16_t));
+
+    union
+    {
+        uint8_t i8[8];
+        uint16_t i16[4];
+        uint32_t i32[2];
+        uint64_t i64[1];
+        double f;
+    } fp_dp;
+
+    uint16_t u16 = ((uint8_t)buf[0] << 8) + (uint8_t)buf[1];
+    int16_t exp = (int16_t)((u16 >> 10) & 0x1fU) - 15;
+
+    /* Reconstruct IEEE double into little endian order first, then convert
+     * to host order.
+     */
+
+    memset((void *)&fp_dp, 0, sizeof(fp_dp));
+
+    if (exp == -15)
+    {
+        /* Zero or denormal; but note that half float
+         * denormals become double normals.
+         */
+        if ((u16 & 0x03ffU) == 0)
+        {
+            fp_dp.i8[7] = buf[0] & 0x80U;
+        }
+        else
+        {
+            /* Create denormal by first creating a double that
+             * contains the denormal bits and a leading implicit
+             * 1-bit.  Then subtract away the implicit 1-bit.
+             *
+             *    0.mmmmmmmmmm * 2^-14
+             *    1.mmmmmmmmmm 0.... * 2^-14
+             *   -1.0000000000 0.... * 2^-14
+             *
+             * Double exponent: -14 + 1023 = 0x3f1
+             */
+            fp_dp.i8[7] = 0x3fU;
+            fp_dp.i8[6] = 0x10U + (uint8_t)((u16 >> 6) & 0x0fU);
+            fp_dp.i8[5] = (uint8_t)((u16 << 2) & 0xffU); /* Mask is really 0xfcU */
+
+            fp_dp.f = fp_dp.f - (double)0.00006103515625; /* 2^(-14) */
+            if (u16 & 0x8000U)
+            {
+                fp_dp.f = -fp_dp.f;
+            }
+            return mp_obj_new_float((mp_float_t)fp_dp.f);
+        }
+    }
+    else if (exp == 16)
+    {
+        /* +/- Inf or NaN. */
+        if ((u16 & 0x03ffU) == 0)
+        {
+            fp_dp.i8[7] = (buf[0] & 0x80U) + 0x7fU;
+            fp_dp.i8[6] = 0xf0U;
+        }
+        else
+        {
+            /* Create a 'quiet NaN' with highest
+             * bit set (there are some platforms
+             * where the NaN payload convention is
+             * the opposite).  Keep sign.
+             */
+            fp_dp.i8[7] = (buf[0] & 0x80U) + 0x7fU;
+            fp_dp.i8[6] = 0xf8U;
+        }
+    }
+    else
+    {
+        /* Normal. */
+        uint32_t tmp = 0;
+        tmp = (buf[0] & 0x80U) ? 0x80000000UL : 0UL;
+        tmp += (uint32_t)(exp + 1023) << 20;
+        tmp += (uint32_t)(buf[0] & 0x03U) << 18;
+        tmp += (uint32_t)(buf[1] & 0xffU) << 10;
+        fp_dp.i8[7] = (tmp >> 24) & 0xffU;
+        fp_dp.i8[6] = (tmp >> 16) & 0xffU;
+        fp_dp.i8[5] = (tmp >> 8) & 0xffU;
+        fp_dp.i8[4] = (tmp >> 0) & 0xffU;
+    }
+
+    return mp_obj_new_float((mp_float_t)fp_dp.f);
+}
+
+static mp_obj_t cbor_load_float(const byte ai, mp_cbor_reader_t *reader)
+{
+    const byte *buf = cbor_reader_take(reader, sizeof(uint32_t));
+
+    union
+    {
+        uint8_t i8[4];
+        uint16_t i16[2];
+        uint32_t i32[1];
+        float f;
+    } fp_sp;
+
+    memset((void *)&fp_sp, 0, sizeof(fp_sp));
+    // memcpy((void *)&fp_dp.i8, (const void *)buf, sizeof(uint32_t));
+
+    long long val = mp_binary_get_int(sizeof(uint32_t), true, 1, buf);
+    fp_sp.i32[0] = val;
+
+    return mp_obj_new_float((mp_float_t)fp_sp.f);
+}
+
+static mp_obj_t cbor_load_double(const byte ai, mp_cbor_reader_t *reader)
+{
+    const byte *buf = cbor_reader_take(reader, sizeof(uint64_t));
+
+    union
+    {
+        uint8_t i8[8];
+        uint16_t i16[4];
+        uint32_t i32[2];
+        uint64_t i64[1];
+        double f;
+    } fp_dp;
+
+    memset((void *)&fp_dp, 0, sizeof(fp_dp));
+    long long val = mp_binary_get_int(sizeof(uint64_t), true, 1, buf);
+    fp_dp.i64[0] = val;
+
+    return mp_obj_new_float((mp_float_t)fp_dp.f);
+}
+#endif
+
+static mp_obj_t cbor_load_special(const byte ai, mp_cbor_reader_t *reader)
+{
+    switch (ai)
+    {
+    case 20:
+    {
+        return mp_const_false;
+    }
+    case 21:
+    {
+        return mp_const_true;
+    }
+    case 22:
+    case 23:
+    {
+        return mp_const_none;
+    }
+    case 24:
+    {
+        break;
+    }
+    case 25:
+    {
+/* half-float (2 bytes) */
+#if MICROPY_PY_BUILTINS_FLOAT
+        return cbor_load_half_float(ai, reader);
+#else
+        break;
+#endif
+    }
+    case 26:
+    {
+/* float (4 bytes) */
+#if MICROPY_PY_BUILTINS_FLOAT
+        return cbor_load_float(ai, reader);
+#else
+        break;
+#endif
+    }
+    case 27:
+    {
+/* double (8 bytes) */
+#if MICROPY_PY_BUILTINS_FLOAT
+        return cbor_load_double(ai, reader);
+#else
+        break;
+#endif
+    }
+    case CBOR_AI_INDEFINITE:
+    {
+        mp_raise_ValueError(MP_ERROR_TEXT("Unexpected break"));
+    }
+    default:
+    {
+        break;
+    }
+    }
+
+    nlr_raise(mp_obj_new_exception_msg_varg(&mp_type_ValueError, MP_ERROR_TEXT("Unsupported additional information: %d"), ai));
+}
+
+static mp_cbor_load_func_t load_functions_map[] = {
+    {0, cbor_load_int},
+    {1, cbor_load_uint},
+    {2, cbor_load_bytes},
+    {3, cbor_load_text},
+    {4, cbor_load_list},
+    {5, cbor_load_dict},
+    {6, cbor_load_tag},
+    {7, cbor_load_special},
+};
+
+static mp_obj_t cbor_loads(mp_cbor_reader_t *reader)
+{
+    MP_STACK_CHECK();
+
+    byte fb = *cbor_reader_take(reader, 1);
+    byte mt = (fb >> 5);
+    byte ai = (fb & 0x1f);
+    if (mt > 7)
+    {
+        cbor_unsupported_major_type(ai, reader);
+    }
+    return load_functions_map[mt]._func(ai, reader);
+}
+
+// Move the reader past one item by parsing its heads only, no objects are built
+static void cbor_skip(mp_cbor_reader_t *reader)
+{
+    MP_STACK_CHECK();
+    byte fb = *cbor_reader_take(reader, 1);
+    byte mt = (fb >> 5);
+    byte ai = (fb & 0x1f);
+    if (ai == CBOR_AI_INDEFINITE)
+    {
+        if (mt == 7)
+        {
+            mp_raise_ValueError(MP_ERROR_TEXT("Unexpected break"));
+        }
+        if (mt < 2 || mt == 6)
+        {
+            mp_raise_ValueError(MP_ERROR_TEXT("Invalid additional information"));
+        }
+        while (!cbor_reader_break(reader))
+        {
+            // string chunks must be definite-length strings of the same type
+            if ((mt == 2 || mt == 3) && ((*reader->cur >> 5) != mt || (*reader->cur & 0x1f) == CBOR_AI_INDEFINITE))
+            {
+                mp_raise_ValueError(MP_ERROR_TEXT("Invalid chunk"));
+            }
+            cbor_skip(reader);
+        }
+        return;
+    }
+
+    // for major type 7 this also steps over the simple value or float
+    uint64_t val = cbor_load_head(ai, reader);
+    switch (mt)
+    {
+    case 2:
+    case 3:
+    {
+        if (val > SIZE_MAX)
+        {
+            mp_raise_ValueError(MP_ERROR_TEXT("Length too large"));
+        }
+        cbor_reader_take(reader, (size_t)val);
+        break;
+    }
+    case 4:
+    case 5:
+    {
+        for (; val > 0; val--)
+        {
+            cbor_skip(reader);
+            if (mt == 5)
+            {
+                cbor_skip(reader);
+            }
+        }
+        break;
+    }
+    case 6:
+    {
+        cbor_skip(reader);
+        break;
+    }
+    default:
+    {
+        break;
+    }
+    }
+}
+
+static mp_obj_t cbor_decode(size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args)
+{
+    enum
+    {
+        ARG_buf,
+        ARG_tag_hook
+    };
+    static const mp_arg_t allowed_args[] = {
+        {MP_QSTR_buf, MP_ARG_REQUIRED | MP_ARG_OBJ, {.u_obj = MP_OBJ_NULL}},
+        {MP_QSTR_tag_hook, MP_ARG_OBJ, {.u_rom_obj = MP_ROM_NONE}},
+    };
+    mp_arg_val_t args[MP_ARRAY_SIZE(allowed_args)];
+    mp_arg_parse_all(n_args, pos_args, kw_args, MP_ARRAY_SIZE(allowed_args), allowed_args, args);
+
+    mp_cbor_reader_t reader;
+    cbor_reader_init_source(&reader, args[ARG_buf].u_obj, 0);
+    reader.tag_hook = args[ARG_tag_hook].u_obj;
+    return cbor_loads(&reader);
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_KW(cbor_decode_obj, 1, cbor_decode);
+
+static mp_obj_t cbor_load(size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args)
+{
+    enum
+    {
+        ARG_stream,
+        ARG_tag_hook
+    };
+    static const mp_arg_t allowed_args[] = {
+        {MP_QSTR_stream, MP_ARG_REQUIRED | MP_ARG_OBJ, {.u_obj = MP_OBJ_NULL}},
+        {MP_QSTR_tag_hook, MP_ARG_OBJ, {.u_rom_obj = MP_ROM_NONE}},
+    };
+    mp_arg_val_t args[MP_ARRAY_SIZE(allowed_args)];
+    mp_arg_parse_all(n_args, pos_args, kw_args, MP_ARRAY_SIZE(allowed_args), allowed_args, args);
+
+    mp_cbor_reader_t reader;
+    cbor_reader_init_stream(&reader, args[ARG_stream].u_obj, 32);
+    reader.tag_hook = args[ARG_tag_hook].u_obj;
+    mp_obj_t val = cbor_loads(&reader);
+    cbor_reader_deinit(&reader);
+    return val;
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_KW(cbor_load_obj, 1, cbor_load);
+
+static mp_obj_t cbor_decode_seq(size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args)
+{
+    enum
+    {
+        ARG_buf,
+        ARG_tag_hook
+    };
+    static const mp_arg_t allowed_args[] = {
+        {MP_QSTR_buf, MP_ARG_REQUIRED | MP_ARG_OBJ, {.u_obj = MP_OBJ_NULL}},
+        {MP_QSTR_tag_hook, MP_ARG_OBJ, {.u_rom_obj = MP_ROM_NONE}},
+    };
+    mp_arg_val_t args[MP_ARRAY_SIZE(allowed_args)];
+    mp_arg_parse_all(n_args, pos_args, kw_args, MP_ARRAY_SIZE(allowed_args), allowed_args, args);
+
+    mp_cbor_reader_t reader;
+    cbor_reader_init_source(&reader, args[ARG_buf].u_obj, 0);
+    reader.tag_hook = args[ARG_tag_hook].u_obj;
+    mp_obj_t items = mp_obj_new_list(0, NULL);
+    while (!cbor_reader_at_end(&reader))
+    {
+        mp_obj_list_append(items, cbor_loads(&reader));
+    }
+    return items;
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_KW(cbor_decode_seq_obj, 1, cbor_decode_seq);
+
+typedef struct _mp_obj_cbor_iter_decode_t
+{
+    mp_obj_base_t base;
+    // keeps the source alive, MP_OBJ_NULL once the sequence is exhausted
+    mp_obj_t source;
+    // a bytearray may be resized between items, so buffers are fetched
+    // again on every step and only the offset of the next item is kept
+    size_t offset;
+    // streams read through it, buffers only use its tag_hook
+    mp_cbor_reader_t reader;
+} mp_obj_cbor_iter_decode_t;
+
+static mp_obj_t cbor_iter_decode_iternext(mp_obj_t self_in)
+{
+    mp_obj_cbor_iter_decode_t *self = MP_OBJ_TO_PTR(self_in);
+    if (self->source == MP_OBJ_NULL)
+    {
+        return MP_OBJ_STOP_ITERATION;
+    }
+    if (self->reader.stream_readinto[0] != MP_OBJ_NULL)
+    {
+        if (cbor_reader_at_end(&self->reader))
+        {
+            cbor_reader_deinit(&self->reader);
+            self->source = MP_OBJ_NULL;
+            return MP_OBJ_STOP_ITERATION;
+        }
+        return cbor_loads(&self->reader);
+    }
+
+    mp_buffer_info_t bufinfo;
+    mp_get_buffer_raise(self->source, &bufinfo, MP_BUFFER_READ);
+    if (self->offset >= bufinfo.len)
+    {
+        self->source = MP_OBJ_NULL;
+        return MP_OBJ_STOP_ITERATION;
+    }
+    mp_cbor_reader_t reader;
+    cbor_reader_init_source(&reader, self->source, self->offset);
+    reader.tag_hook = self->reader.tag_hook;
+    mp_obj_t item = cbor_loads(&reader);
+    self->offset = reader.cur - reader.base;
+    return item;
+}
+
+static MP_DEFINE_CONST_OBJ_TYPE(
+    cbor_iter_decode_type,
+    MP_QSTR_iterator,
+    MP_TYPE_FLAG_ITER_IS_ITERNEXT,
+    iter, cbor_iter_decode_iternext);
+
+static mp_obj_t cbor_iter_decode(size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args)
+{
+    enum
+    {
+        ARG_source,
+        ARG_tag_hook
+    };
+    static const mp_arg_t allowed_args[] = {
+        {MP_QSTR_source, MP_ARG_REQUIRED | MP_ARG_OBJ, {.u_obj = MP_OBJ_NULL}},
+        {MP_QSTR_tag_hook, MP_ARG_OBJ, {.u_rom_obj = MP_ROM_NONE}},
+    };
+    mp_arg_val_t args[MP_ARRAY_SIZE(allowed_args)];
+    mp_arg_parse_all(n_args, pos_args, kw_args, MP_ARRAY_SIZE(allowed_args), allowed_args, args);
+
+    // buffers are decoded in place, anything else is read as a stream
+    mp_obj_cbor_iter_decode_t *self = mp_obj_malloc(mp_obj_cbor_iter_decode_t, &cbor_iter_decode_type);
+    self->source = args[ARG_source].u_obj;
+    self->offset = 0;
+    mp_buffer_info_t bufinfo;
+    if (mp_get_buffer(self->source, &bufinfo, MP_BUFFER_READ))
+    {
+        cbor_reader_init_buffer(&self->reader, NULL, 0);
+    }
+    else
+    {
+        // the iterator owns the stream, so read it in large pieces
+        cbor_reader_init_stream(&self->reader, self->source, 256);
+        self->reader.read_ahead = true;
+    }
+    self->reader.tag_hook = args[ARG_tag_hook].u_obj;
+    return MP_OBJ_FROM_PTR(self);
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_KW(cbor_iter_decode_obj, 1, cbor_iter_decode);
+
+// Lazy views over an encoded array or map. They keep the source object and
+// offsets rather than pointers, so the source buffer stays alive and may move.
+typedef struct _mp_obj_cbor_view_t
+{
+    mp_obj_base_t base;
+    mp_obj_t source;
+    size_t start;
+    size_t len;
+    bool is_map;
+    mp_obj_t tag_hook;
+} mp_obj_cbor_view_t;
+
+typedef struct _mp_obj_cbor_view_iter_t
+{
+    mp_obj_base_t base;
+    mp_obj_cbor_view_t *view;
+    size_t offset;
+    size_t remaining;
+} mp_obj_cbor_view_iter_t;
+
+static mp_obj_t cbor_lazy_load(mp_obj_t source, mp_cbor_reader_t *reader, bool advance);
+
+// Position a reader at 'offset' in the view's source
+static void cbor_view_reader(mp_obj_cbor_view_t *view, size_t offset, mp_cbor_reader_t *reader)
+{
+    cbor_reader_init_source(reader, view->source, offset);
+    reader->tag_hook = view->tag_hook;
+}
+
+// Compare the next map key with 'key' and step past it. Text keys are
+// compared in place, others are decoded.
+static bool cbor_key_matches(mp_cbor_reader_t *reader, mp_obj_t key)
+{
+    if (mp_obj_is_str(key) && reader->cur < reader->end && (*reader->cur >> 5) == 3 && (*reader->cur & 0x1f) != CBOR_AI_INDEFINITE)
+    {
+        byte fb = *cbor_reader_take(reader, 1);
+        size_t n_bytes = cbor_load_size(fb & 0x1f, reader);
+        const byte *data = cbor_reader_take(reader, n_bytes);
+        size_t key_len;
+        const char *key_data = mp_obj_str_get_data(key, &key_len);
+        return n_bytes == key_len && memcmp(data, key_data, n_bytes) == 0;
+    }
+    return mp_obj_equal(cbor_loads(reader), key);
+}
+
+// Scan 'n_pairs' map entries for 'key', leaving the reader on its value
+static bool cbor_map_find(mp_cbor_reader_t *reader, size_t n_pairs, mp_obj_t key)
+{
+    for (size_t i = 0; i < n_pairs; i++)
+    {
+        if (cbor_key_matches(reader, key))
+        {
+            return true;
+        }
+        cbor_skip(reader);
+    }
+    return false;
+}
+
+static mp_obj_t cbor_view_unary_op(mp_unary_op_t op, mp_obj_t self_in)
+{
+    mp_obj_cbor_view_t *self = MP_OBJ_TO_PTR(self_in);
+    switch (op)
+    {
+    case MP_UNARY_OP_BOOL:
+        return mp_obj_new_bool(self->len != 0);
+    case MP_UNARY_OP_LEN:
+        return mp_obj_new_int_from_uint(self->len);
+    default:
+        return MP_OBJ_NULL; // op not supported
+    }
+}
+
+static mp_obj_t cbor_view_subscr(mp_obj_t self_in, mp_obj_t index, mp_obj_t value)
+{
+    if (value != MP_OBJ_SENTINEL)
+    {
+        // views are read-only
+        return MP_OBJ_NULL;
+    }
+    mp_obj_cbor_view_t *self = MP_OBJ_TO_PTR(self_in);
+    mp_cbor_reader_t reader;
+    cbor_view_reader(self, self->start, &reader);
+    if (self->is_map)
+    {
+        if (!cbor_map_find(&reader, self->len, index))
+        {
+            nlr_raise(mp_obj_new_exception_arg1(&mp_type_KeyError, index));
+        }
+    }
+    else
+    {
+        for (size_t i = mp_get_index(self->base.type, self->len, index, false); i > 0; i--)
+        {
+            cbor_skip(&reader);
+        }
+    }
+    return cbor_lazy_load(self->source, &reader, false);
+}
+
+// Arrays yield their elements and maps their keys, like list and dict
+static mp_obj_t cbor_view_iter_iternext(mp_obj_t self_in)
+{
+    mp_obj_cbor_view_iter_t *self = MP_OBJ_TO_PTR(self_in);
+    if (self->remaining == 0)
+    {
+        return MP_OBJ_STOP_ITERATION;
+    }
+    mp_cbor_reader_t reader;
+    cbor_view_reader(self->view, self->offset, &reader);
+    mp_obj_t item;
+    if (self->view->is_map)
+    {
+        item = cbor_loads(&reader);
+        cbor_skip(&reader);
+    }
+    else
+    {
+        item = cbor_lazy_load(self->view->source, &reader, true);
+    }
+    self->offset = reader.cur - reader.base;
+    self->remaining--;
+    return item;
+}
+
+static MP_DEFINE_CONST_OBJ_TYPE(
+    cbor_view_iter_type,
+    MP_QSTR_iterator,
+    MP_TYPE_FLAG_ITER_IS_ITERNEXT,
+    iter, cbor_view_iter_iternext);
+
+static mp_obj_t cbor_view_getiter(mp_obj_t self_in, mp_obj_iter_buf_t *iter_buf)
+{
+    mp_obj_cbor_view_t *view = MP_OBJ_TO_PTR(self_in);
+    mp_obj_cbor_view_iter_t *self = mp_obj_malloc(mp_obj_cbor_view_iter_t, &cbor_view_iter_type);
+    self->view = view;
+    self->offset = view->start;
+    self->remaining = view->len;
+    return MP_OBJ_FROM_PTR(self);
+}
+
+static MP_DEFINE_CONST_OBJ_TYPE(
+    cbor_array_view_type,
+    MP_QSTR_CBORArrayView,
+    MP_TYPE_FLAG_ITER_IS_GETITER,
+    unary_op, cbor_view_unary_op,
+    subscr, cbor_view_subscr,
+    iter, cbor_view_getiter);
+
+static MP_DEFINE_CONST_OBJ_TYPE(
+    cbor_map_view_type,
+    MP_QSTR_CBORMapView,
+    MP_TYPE_FLAG_ITER_IS_GETITER,
+    unary_op, cbor_view_unary_op,
+    subscr, cbor_view_subscr,
+    iter, cbor_view_getiter);
+
+// Decode the next item, arrays and maps become views over 'source'. With
+// 'advance' the reader is moved past a container, otherwise it is left
+// inside and a definite-length container costs nothing to open.
+static mp_obj_t cbor_lazy_load(mp_obj_t source, mp_cbor_reader_t *reader, bool advance)
+{
+    byte fb = *cbor_reader_take(reader, 1);
+    byte mt = (fb >> 5);
+    byte ai = (fb & 0x1f);
+    if (mt != 4 && mt != 5)
+    {
+        reader->cur--;
+        return cbor_loads(reader);
+    }
+
+    mp_obj_cbor_view_t *view = mp_obj_malloc(mp_obj_cbor_view_t, (mt == 4) ? &cbor_array_view_type : &cbor_map_view_type);
+    view->source = source;
+    view->is_map = (mt == 5);
+    view->tag_hook = reader->tag_hook;
+    if (ai == CBOR_AI_INDEFINITE)
+    {
+        // the length of an indefinite-length container takes a scan
+        view->start = reader->cur - reader->base;
+        view->len = 0;
+        while (!cbor_reader_break(reader))
+        {
+            cbor_skip(reader);
+            if (view->is_map)
+            {
+                cbor_skip(reader);
+            }
+            view->len++;
+        }
+        return MP_OBJ_FROM_PTR(view);
+    }
+
+    view->len = cbor_load_size(ai, reader);
+    view->start = reader->cur - reader->base;
+    // every item takes at least one byte, so reject counts the rest of the
+    // buffer can't hold before len() and indexing trust them
+    size_t remaining = reader->end - reader->cur;
+    if (view->len > (view->is_map ? remaining / 2 : remaining))
+    {
+        mp_raise_ValueError(MP_ERROR_TEXT("Buffer to small"));
+    }
+    for (size_t i = 0; advance && i < view->len; i++)
+    {
+        cbor_skip(reader);
+        if (view->is_map)
+        {
+            cbor_skip(reader);
+        }
+    }
+    return MP_OBJ_FROM_PTR(view);
+}
+
+static mp_obj_t cbor_decode_lazy(size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args)
+{
+    enum
+    {
+        ARG_buf,
+        ARG_tag_hook
+    };
+    static const mp_arg_t allowed_args[] = {
+        {MP_QSTR_buf, MP_ARG_REQUIRED | MP_ARG_OBJ, {.u_obj = MP_OBJ_NULL}},
+        {MP_QSTR_tag_hook, MP_ARG_OBJ, {.u_rom_obj = MP_ROM_NONE}},
+    };
+    mp_arg_val_t args[MP_ARRAY_SIZE(allowed_args)];
+    mp_arg_parse_all(n_args, pos_args, kw_args, MP_ARRAY_SIZE(allowed_args), allowed_args, args);
+
+    mp_cbor_reader_t reader;
+    cbor_reader_init_source(&reader, args[ARG_buf].u_obj, 0);
+    reader.tag_hook = args[ARG_tag_hook].u_obj;
+    return cbor_lazy_load(args[ARG_buf].u_obj, &reader, false);
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_KW(cbor_decode_lazy_obj, 1, cbor_decode_lazy);
+
+static mp_obj_t cbor_item_span(size_t n_args, const mp_obj_t *args)
+{
+    mp_buffer_info_t bufinfo;
+    mp_get_buffer_raise(args[0], &bufinfo, MP_BUFFER_READ);
+    mp_int_t offset = (n_args > 1) ? mp_obj_get_int(args[1]) : 0;
+    if (offset < 0 || (size_t)offset > bufinfo.len)
+    {
+        mp_raise_ValueError(MP_ERROR_TEXT("Invalid offset"));
+    }
+    mp_cbor_reader_t reader;
+    cbor_reader_init_buffer(&reader, (const byte *)bufinfo.buf + offset, bufinfo.len - offset);
+    cbor_skip(&reader);
+    mp_obj_t span[2] = {
+        mp_obj_new_int_from_uint(offset),
+        mp_obj_new_int_from_uint(reader.cur - (const byte *)bufinfo.buf),
+    };
+    return mp_obj_new_tuple(2, span);
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(cbor_item_span_obj, 1, 2, cbor_item_span);
+
+// Follow 'path' from the item at the reader, one map key or array index per
+// step, leaving the reader on the target. Tags along the way are stepped
+// over. Returns false when the path doesn't exist in the document.
+static bool cbor_path_seek(mp_cbor_reader_t *reader, mp_obj_t path)
+{
+    GET_ARRAY(path);
+    for (size_t i = 0; i < array_len; i++)
+    {
+        byte fb = *cbor_reader_take(reader, 1);
+        while ((fb >> 5) == 6)
+        {
+            cbor_load_head(fb & 0x1f, reader);
+            fb = *cbor_reader_take(reader, 1);
+        }
+        byte mt = (fb >> 5);
+        byte ai = (fb & 0x1f);
+        mp_obj_t step = array_items[i];
+        if (mt == 5)
         {
-            vstr_add_byte(data_vstr, (byte)(mt | data));
+            if (ai != CBOR_AI_INDEFINITE)
+            {
+                if (!cbor_map_find(reader, cbor_load_size(ai, reader), step))
+                {
+                    return false;
+                }
+                continue;
+            }
+            bool found = false;
+            while (!found && !cbor_reader_break(reader))
+            {
+                found = cbor_key_matches(reader, step);
+                if (!found)
+                {
+                    cbor_skip(reader);
+                }
+            }
+            if (!found)
+            {
+                return false;
+            }
         }
-        else if (data <= 0xff)
+        else if (mt == 4)
         {
-            vstr_add_byte(data_vstr, (byte)(mt | 24));
-            vstr_add_byte(data_vstr, (byte)(data));
+            mp_int_t index;
+            if (!mp_obj_get_int_maybe(step, &index))
+            {
+                return false;
+            }
+            if (ai != CBOR_AI_INDEFINITE)
+            {
+                size_t len = cbor_load_size(ai, reader);
+                if (index < 0)
+                {
+                    index += len;
+                }
+                if (index < 0 || (size_t)index >= len)
+                {
+                    return false;
+                }
+            }
+            else if (index < 0)
+            {
+                // counting from the end would need a scan to the break first
+                return false;
+            }
+            for (; index > 0; index--)
+            {
+                if (ai == CBOR_AI_INDEFINITE && cbor_reader_break(reader))
+                {
+                    return false;
+                }
+                cbor_skip(reader);
+            }
+            if (ai == CBOR_AI_INDEFINITE && cbor_reader_break(reader))
+            {
+                return false;
+            }
         }
         else
         {
-            mp_int_t size = 0;
-            if (data <= 0xffff)
+            return false;
+        }
+    }
+    return true;
+}
+
+static mp_obj_t cbor_get(size_t n_args, const mp_obj_t *args)
+{
+    mp_buffer_info_t bufinfo;
+    mp_get_buffer_raise(args[0], &bufinfo, MP_BUFFER_READ);
+    mp_cbor_reader_t reader;
+    cbor_reader_init_buffer(&reader, (const byte *)bufinfo.buf, bufinfo.len);
+    if (!cbor_path_seek(&reader, args[1]))
+    {
+        return (n_args > 2) ? args[2] : mp_const_none;
+    }
+    return cbor_loads(&reader);
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(cbor_get_obj, 2, 3, cbor_get);
+
+static mp_obj_t cbor_get_many(size_t n_args, const mp_obj_t *args)
+{
+    mp_buffer_info_t bufinfo;
+    mp_get_buffer_raise(args[0], &bufinfo, MP_BUFFER_READ);
+    mp_obj_t missing = (n_args > 2) ? args[2] : mp_const_none;
+    GET_ARRAY(args[1]);
+    mp_obj_t values = mp_obj_new_list(array_len, NULL);
+    mp_obj_t *value_items = ((mp_obj_list_t *)MP_OBJ_TO_PTR(values))->items;
+    for (size_t i = 0; i < array_len; i++)
+    {
+        // every path starts again from the root item
+        mp_cbor_reader_t reader;
+        cbor_reader_init_buffer(&reader, (const byte *)bufinfo.buf, bufinfo.len);
+        value_items[i] = cbor_path_seek(&reader, array_items[i]) ? cbor_loads(&reader) : missing;
+    }
+    return values;
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(cbor_get_many_obj, 2, 3, cbor_get_many);
+
+// Open container in the Decoder scan, indefinite ones stay open until
+// their break byte whatever 'remaining' says
+typedef struct _mp_cbor_decoder_frame_t
+{
+    uint64_t remaining;
+    bool indefinite;
+} mp_cbor_decoder_frame_t;
+
+typedef struct _mp_obj_cbor_decoder_t
+{
+    mp_obj_base_t base;
+    vstr_t vstr;
+    size_t scanned;
+    uint64_t pending;
+    size_t depth;
+    size_t stack_alloc;
+    mp_cbor_decoder_frame_t *stack;
+    mp_obj_t tag_hook;
+    // error held back so that items completed before it could be returned
+    mp_obj_t error;
+    // set while decoding, tag_hook must not feed() into the buffer in use
+    bool busy;
+} mp_obj_cbor_decoder_t;
+
+// Account for one finished item in the innermost open container, closing
+// every container this completes. Returns true once a top-level item is done.
+static bool cbor_decoder_item_done(mp_obj_cbor_decoder_t *self)
+{
+    while (self->depth > 0)
+    {
+        mp_cbor_decoder_frame_t *frame = &self->stack[self->depth - 1];
+        if (frame->indefinite || --frame->remaining > 0)
+        {
+            return false;
+        }
+        self->depth--;
+    }
+    return true;
+}
+
+static void cbor_decoder_push(mp_obj_cbor_decoder_t *self, uint64_t n_items, bool indefinite)
+{
+    if (self->depth == self->stack_alloc)
+    {
+        self->stack = m_renew(mp_cbor_decoder_frame_t, self->stack, self->stack_alloc, self->stack_alloc * 2);
+        self->stack_alloc *= 2;
+    }
+    mp_cbor_decoder_frame_t *frame = &self->stack[self->depth++];
+    frame->remaining = n_items;
+    frame->indefinite = indefinite;
+}
+
+// Resume the structural scan of the buffered input. Only heads are parsed and
+// string payloads skipped; returns true when a complete top-level item ends
+// at self->scanned.
+static bool cbor_decoder_scan(mp_obj_cbor_decoder_t *self)
+{
+    const byte *buf = (const byte *)self->vstr.buf;
+    size_t len = self->vstr.len;
+
+    for (;;)
+    {
+        if (self->pending > 0)
+        {
+            size_t skip = (size_t)MIN(self->pending, (uint64_t)(len - self->scanned));
+            self->scanned += skip;
+            self->pending -= skip;
+            if (self->pending > 0)
+            {
+                return false;
+            }
+            if (cbor_decoder_item_done(self))
+            {
+                return true;
+            }
+        }
+
+        if (self->scanned >= len)
+        {
+            return false;
+        }
+
+        byte fb = buf[self->scanned];
+        byte mt = (fb >> 5);
+        byte ai = (fb & 0x1f);
+        size_t n_bytes = 0;
+        if (ai >= 24 && ai <= 27)
+        {
+            n_bytes = (1 << (ai - 24));
+        }
+        else if (ai > 27 && (ai != CBOR_AI_INDEFINITE || mt < 2 || mt == 6))
+        {
+            // only strings, containers and the break may be indefinite
+            mp_raise_ValueError(MP_ERROR_TEXT("Invalid additional information"));
+        }
+        if (len - self->scanned < 1 + n_bytes)
+        {
+            return false;
+        }
+        uint64_t val = (ai < 24) ? ai : cbor_read_uint_be(buf + self->scanned + 1, n_bytes);
+        self->scanned += 1 + n_bytes;
+
+        switch (mt)
+        {
+        case 2:
+        case 3:
+        {
+            if (ai == CBOR_AI_INDEFINITE)
+            {
+                // the chunks are scanned as the items of the string
+                cbor_decoder_push(self, 0, true);
+                continue;
+            }
+            self->pending = val;
+            if (val > 0)
+            {
+                continue;
+            }
+            break;
+        }
+        case 4:
+        case 5:
+        {
+            if (ai == CBOR_AI_INDEFINITE)
+            {
+                cbor_decoder_push(self, 0, true);
+                continue;
+            }
+            // no buffer could hold more items, and doubling must not wrap
+            if (val > SIZE_MAX / 2)
+            {
+                mp_raise_ValueError(MP_ERROR_TEXT("Length too large"));
+            }
+            if (mt == 5)
+            {
+                val *= 2;
+            }
+            if (val > 0)
+            {
+                cbor_decoder_push(self, val, false);
+                continue;
+            }
+            break;
+        }
+        case 6:
+        {
+            // a tag wraps the item that follows it
+            continue;
+        }
+        case 7:
+        {
+            if (ai == CBOR_AI_INDEFINITE)
+            {
+                // the break closes the innermost indefinite-length item
+                if (self->depth == 0 || !self->stack[self->depth - 1].indefinite)
+                {
+                    mp_raise_ValueError(MP_ERROR_TEXT("Unexpected break"));
+                }
+                self->depth--;
+            }
+            break;
+        }
+        default:
+        {
+            break;
+        }
+        }
+
+        if (cbor_decoder_item_done(self))
+        {
+            return true;
+        }
+    }
+}
+
+static mp_obj_t cbor_decoder_make_new(const mp_obj_type_t *type, size_t n_args, size_t n_kw, const mp_obj_t *args)
+{
+    enum
+    {
+        ARG_tag_hook
+    };
+    static const mp_arg_t allowed_args[] = {
+        {MP_QSTR_tag_hook, MP_ARG_OBJ, {.u_rom_obj = MP_ROM_NONE}},
+    };
+    mp_arg_val_t parsed[MP_ARRAY_SIZE(allowed_args)];
+    mp_arg_parse_all_kw_array(n_args, n_kw, args, MP_ARRAY_SIZE(allowed_args), allowed_args, parsed);
+
+    mp_obj_cbor_decoder_t *self = mp_obj_malloc(mp_obj_cbor_decoder_t, type);
+    vstr_init(&self->vstr, 16);
+    self->scanned = 0;
+    self->pending = 0;
+    self->depth = 0;
+    self->stack_alloc = 4;
+    self->stack = m_new(mp_cbor_decoder_frame_t, self->stack_alloc);
+    self->tag_hook = parsed[ARG_tag_hook].u_obj;
+    self->error = MP_OBJ_NULL;
+    self->busy = false;
+    return MP_OBJ_FROM_PTR(self);
+}
+
+static mp_obj_t cbor_decoder_feed(mp_obj_t self_in, mp_obj_t obj_data)
+{
+    mp_obj_cbor_decoder_t *self = MP_OBJ_TO_PTR(self_in);
+    if (self->busy)
+    {
+        mp_raise_msg(&mp_type_RuntimeError, MP_ERROR_TEXT("Decoder is busy"));
+    }
+    mp_buffer_info_t bufinfo;
+    mp_get_buffer_raise(obj_data, &bufinfo, MP_BUFFER_READ);
+    vstr_add_strn(&self->vstr, (const char *)bufinfo.buf, bufinfo.len);
+    if (self->error != MP_OBJ_NULL)
+    {
+        // report the error held back by the previous call, the new data
+        // stays buffered for the next one
+        mp_obj_t error = self->error;
+        self->error = MP_OBJ_NULL;
+        nlr_raise(error);
+    }
+
+    mp_obj_t items = mp_obj_new_list(0, NULL);
+    volatile size_t start = 0;
+    volatile bool decoding = false;
+    nlr_buf_t nlr;
+    self->busy = true;
+    if (nlr_push(&nlr) == 0)
+    {
+        while (cbor_decoder_scan(self))
+        {
+            mp_cbor_reader_t reader;
+            cbor_reader_init_buffer(&reader, (const byte *)self->vstr.buf + start, self->scanned - start);
+            reader.tag_hook = self->tag_hook;
+            start = self->scanned;
+            decoding = true;
+            mp_obj_list_append(items, cbor_loads(&reader));
+            decoding = false;
+        }
+        nlr_pop();
+        self->busy = false;
+    }
+    else
+    {
+        self->busy = false;
+        if (!decoding)
+        {
+            // malformed head, the framing is lost so drop all buffered input
+            start = self->vstr.len;
+            self->scanned = start;
+            self->depth = 0;
+            self->pending = 0;
+        }
+        // discard the offending input so the next feed() starts cleanly
+        vstr_cut_head_bytes(&self->vstr, start);
+        self->scanned -= start;
+        if (((mp_obj_list_t *)MP_OBJ_TO_PTR(items))->len > 0)
+        {
+            // the completed items are already consumed, hand them over
+            // and raise on the next feed()
+            self->error = MP_OBJ_FROM_PTR(nlr.ret_val);
+            return items;
+        }
+        nlr_jump(nlr.ret_val);
+    }
+
+    // drop the consumed items once, keeping only the partial tail
+    vstr_cut_head_bytes(&self->vstr, start);
+    self->scanned -= start;
+    return items;
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_2(cbor_decoder_feed_obj, cbor_decoder_feed);
+
+static const mp_rom_map_elem_t cbor_decoder_locals_dict_table[] = {
+    {MP_ROM_QSTR(MP_QSTR_feed), MP_ROM_PTR(&cbor_decoder_feed_obj)},
+};
+
+static MP_DEFINE_CONST_DICT(cbor_decoder_locals_dict, cbor_decoder_locals_dict_table);
+
+static MP_DEFINE_CONST_OBJ_TYPE(
+    cbor_decoder_type,
+    MP_QSTR_Decoder,
+    MP_TYPE_FLAG_NONE,
+    make_new, cbor_decoder_make_new,
+    locals_dict, &cbor_decoder_locals_dict);
+
+// True if a float head of size 'ai' holds a value in its shortest form:
+// floats that survive narrowing must use the narrower width and NaN
+// only appears as the half-float 0x7e00.
+static bool cbor_float_is_shortest(byte ai, uint64_t val)
+{
+    if (ai == 25)
+    {
+        return (val & 0x7c00) != 0x7c00 || (val & 0x3ff) == 0 || val == 0x7e00;
+    }
+    if (ai == 26)
+    {
+        uint32_t bits = (uint32_t)val;
+        int exp = (int)((bits >> 23) & 0xff) - 127;
+        uint32_t mant = (bits & 0x7fffff) | 0x800000;
+        if (exp == 128 || (bits & 0x7fffffff) == 0)
+        {
+            // inf, NaN and zero all have a half-float form
+            return false;
+        }
+        if (exp >= -14 && exp <= 15)
+        {
+            return (mant & 0x1fff) != 0;
+        }
+        if (exp >= -24 && exp < -14)
+        {
+            return (mant & ((1UL << (-exp - 1)) - 1)) != 0;
+        }
+        return true;
+    }
+    union
+    {
+        uint64_t i64;
+        double f;
+    } fp_dp;
+    fp_dp.i64 = val;
+    if (isnan(fp_dp.f) || isinf(fp_dp.f))
+    {
+        return false;
+    }
+    // a double that round trips through float has a shorter form
+    return fabs(fp_dp.f) > (double)FLT_MAX || (double)(float)fp_dp.f != fp_dp.f;
+}
+
+// Walk one item of buf checking the RFC 8949 core deterministic encoding
+// rules, returns the end of the item or NULL if a rule is broken.
+static const byte *cbor_check_deterministic(const byte *p, const byte *end)
+{
+    static const uint64_t head_min[] = {24, 0x100, 0x10000, 0x100000000ULL};
+
+    MP_STACK_CHECK();
+    if (p >= end)
+    {
+        return NULL;
+    }
+    byte mt = *p >> 5;
+    byte ai = *p++ & 0x1f;
+    uint64_t val = ai;
+    if (ai >= 24)
+    {
+        // reserved values and indefinite lengths are never deterministic
+        if (ai > 27)
+        {
+            return NULL;
+        }
+        size_t n_bytes = 1 << (ai - 24);
+        if ((size_t)(end - p) < n_bytes)
+        {
+            return NULL;
+        }
+        val = cbor_read_uint_be(p, n_bytes);
+        p += n_bytes;
+        if (mt == 7)
+        {
+            // simple values below 32 must use the one byte form
+            return ((ai == 24) ? val >= 32 : cbor_float_is_shortest(ai, val)) ? p : NULL;
+        }
+        if (val < head_min[ai - 24])
+        {
+            return NULL;
+        }
+    }
+
+    switch (mt)
+    {
+    case 2:
+    case 3:
+        return (val <= (uint64_t)(end - p)) ? p + val : NULL;
+    case 4:
+        while (val-- && p)
+        {
+            p = cbor_check_deterministic(p, end);
+        }
+        return p;
+    case 5:
+    {
+        // keys must be strictly increasing in bytewise order
+        const byte *prev = NULL;
+        size_t prev_len = 0;
+        while (val-- && p)
+        {
+            const byte *key = p;
+            p = cbor_check_deterministic(p, end);
+            if (p == NULL)
             {
-                vstr_add_byte(data_vstr, (byte)(mt | 25));
-                size = sizeof(uint16_t);
+                return NULL;
             }
-            else if (data <= 0xffffffff)
+            size_t key_len = p - key;
+            if (prev != NULL)
             {
-                vstr_add_byte(data_vstr, (byte)(mt | 26));
-                size = sizeof(uint32_t);
+                int cmp = memcmp(prev, key, MIN(prev_len, key_len));
+                if (cmp > 0 || (cmp == 0 && prev_len >= key_len))
+                {
+                    return NULL;
+                }
             }
-            else
+            prev = key;
+            prev_len = key_len;
+            p = cbor_check_deterministic(p, end);
+        }
+        return p;
+    }
+    case 6:
+        if ((val == 2 || val == 3) && p < end)
+        {
+            // bignums are only used past 64 bits and without leading zeros
+            const byte *str = p + 1 + (((*p & 0x1f) >= 24) ? (1 << ((*p & 0x1f) - 24)) : 0);
+            if ((*p >> 5) != 2 || (p = cbor_check_deterministic(p, end)) == NULL)
             {
-                vstr_add_byte(data_vstr, (byte)(mt | 27));
-                size = sizeof(uint64_t);
+                return NULL;
             }
+            return (p - str > 8 && *str != 0) ? p : NULL;
+        }
+        return cbor_check_deterministic(p, end);
+    default:
+        return p;
+    }
+}
+
+static mp_obj_t cbor_is_deterministic(mp_obj_t buf_obj)
+{
+    mp_buffer_info_t bufinfo;
+    mp_get_buffer_raise(buf_obj, &bufinfo, MP_BUFFER_READ);
+    const byte *end = (const byte *)bufinfo.buf + bufinfo.len;
+    return mp_obj_new_bool(cbor_check_deterministic(bufinfo.buf, end) == end);
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_1(cbor_is_deterministic_obj, cbor_is_deterministic);
+
+static void cbor_dump_head(mp_cbor_writer_t *writer, byte mt, uint64_t val)
+{
+    mt = mt << 5;
+    if (val <= 23)
+    {
+        cbor_writer_add_byte(writer, (byte)(mt | val));
+        return;
+    }
+
+    byte ai;
+    size_t size;
+    if (val <= 0xff)
+    {
+        ai = 24;
+        size = sizeof(uint8_t);
+    }
+    else if (val <= 0xffff)
+    {
+        ai = 25;
+        size = sizeof(uint16_t);
+    }
+    else if (val <= 0xffffffff)
+    {
+        ai = 26;
+        size = sizeof(uint32_t);
+    }
+    else
+    {
+        ai = 27;
+        size = sizeof(uint64_t);
+    }
+
+    byte *p = cbor_writer_add_len(writer, 1 + size);
+    p[0] = (byte)(mt | ai);
+    for (size_t i = size; i > 0; i--)
+    {
+        p[i] = (byte)val;
+        val >>= 8;
+    }
+}
+
+static void cbor_dump_int_with_major_type(mp_obj_t obj_data, mp_cbor_writer_t *writer, mp_int_t mt)
+{
+    if (MP_OBJ_IS_SMALL_INT(obj_data))
+    {
+        mp_int_t data = MP_OBJ_SMALL_INT_VALUE(obj_data);
+        if (data < 0)
+        {
+            mt = 1;
+            data = -1 - data;
+        }
+        cbor_dump_head(writer, mt, (uint64_t)data);
+    }
+    else
+    {
+        const mpz_t *z = &((mp_obj_int_t *)MP_OBJ_TO_PTR(obj_data))->mpz;
+        const mpz_t *n = z;
+        mpz_t n_temp;
+        if (mpz_is_neg(z))
+        {
+            // -1 - z, i.e. ~z
+            mt = 1;
+            mpz_init_zero(&n_temp);
+            mpz_not_inpl(&n_temp, z);
+            n = &n_temp;
+        }
 
-            vstr_add_len(data_vstr, size);
-            byte *p = (byte *)data_vstr->buf + 1;
-            mp_binary_set_int(size, 1, p, data);
+        size_t size = (cbor_mpz_bit_length(n) + 7) / 8;
+        if (size <= sizeof(uint64_t))
+        {
+            byte buf[sizeof(uint64_t)];
+            mpz_as_bytes(n, 1, 0, sizeof(buf), buf);
+            cbor_dump_head(writer, mt, cbor_read_uint_be(buf, sizeof(buf)));
+        }
+        else
+        {
+            /* Beyond 64 bits use an unsigned (tag 2) or negative (tag 3)
+             * bignum, RFC 8949 section 3.4.3.
+             */
+            cbor_dump_head(writer, 6, 2 + mt);
+            cbor_dump_head(writer, 2, size);
+            mpz_as_bytes(n, 1, 0, size, cbor_writer_add_len(writer, size));
+        }
+
+        if (n == &n_temp)
+        {
+            mpz_deinit(&n_temp);
         }
     }
-    else
+}
+
+static void cbor_dump_int(mp_obj_t obj_data, mp_cbor_writer_t *writer)
+{
+    cbor_dump_int_with_major_type(obj_data, writer, 0);
+}
+
+// Hand a value with no native encoding to the default= hook, or raise
+static void cbor_dump_unsupported(mp_obj_t obj_data, mp_cbor_writer_t *writer)
+{
+    if (writer->default_func != mp_const_none)
     {
-        mp_int_t size = ((mp_obj_get_int(int_bit_length(obj_data)) + 7) / 8);
-        mpz_t o_temp;
-        mpz_t *o_temp_p = mp_mpz_for_int(obj_data, &o_temp);
+        // let the application convert the value, but not to the same type again
+        mp_obj_t converted = mp_call_function_1(writer->default_func, obj_data);
+        cbor_writer_refetch(writer);
+        if (mp_obj_get_type(converted) != mp_obj_get_type(obj_data))
+        {
+            cbor_dumps(converted, writer);
+            return;
+        }
+    }
 
-        vstr_add_byte(data_vstr, (byte)(mt | 27));
-        vstr_add_len(data_vstr, size);
-        mpz_as_bytes(o_temp_p, 1, 1, data_vstr->len - 1, (byte *)data_vstr->buf + 1);
+    nlr_raise(mp_obj_new_exception_msg_varg(&mp_type_ValueError, MP_ERROR_TEXT("Unsupported value: %s"), mp_obj_get_type_str(obj_data)));
+}
 
-        if (o_temp_p == &o_temp)
+#if MICROPY_PY_ARRAY
+static void cbor_dump_typed_array(mp_obj_t obj_data, mp_cbor_writer_t *writer)
+{
+    mp_buffer_info_t bufinfo;
+    mp_get_buffer_raise(obj_data, &bufinfo, MP_BUFFER_READ);
+    size_t size = mp_binary_get_size('@', bufinfo.typecode, NULL);
+    uint64_t tag = CBOR_TYPED_ARRAY_FIRST;
+    switch (bufinfo.typecode)
+    {
+    case 'f':
+    case 'd':
+        tag |= CBOR_TYPED_ARRAY_FLOAT | ((size == 4) ? 1 : 2);
+        break;
+    case 'b':
+    case 'h':
+    case 'i':
+    case 'l':
+    case 'q':
+        tag |= CBOR_TYPED_ARRAY_SIGNED;
+        // fall through
+    case 'B':
+    case 'H':
+    case 'I':
+    case 'L':
+    case 'Q':
+        for (size_t n = size; n > 1; n >>= 1)
         {
-            mpz_deinit(o_temp_p);
+            tag++;
         }
+        break;
+    default:
+        // object and pointer arrays hold heap addresses, not numbers
+        cbor_dump_unsupported(obj_data, writer);
+        return;
+    }
+    // the payload keeps the host byte order so it is written with one copy
+    if (size > 1 && MP_ENDIANNESS_LITTLE)
+    {
+        tag |= CBOR_TYPED_ARRAY_LITTLE;
     }
+    cbor_dump_head(writer, 6, tag);
+    cbor_dump_head(writer, 2, bufinfo.len);
+    cbor_writer_add_strn(writer, bufinfo.buf, bufinfo.len);
 }
+#endif
 
-static void cbor_dump_int(mp_obj_t obj_data, vstr_t *data_vstr)
+static void cbor_dump_tag(mp_obj_t obj_data, mp_cbor_writer_t *writer)
 {
-    cbor_dump_int_with_major_type(obj_data, data_vstr, 0);
+    // CBORTag only holds tag numbers that fit a 64-bit head
+    mp_obj_cbor_tag_t *self = MP_OBJ_TO_PTR(obj_data);
+    cbor_dump_int_with_major_type(self->tag, writer, 6);
+    cbor_dumps(self->value, writer);
 }
 
 #if MICROPY_PY_BUILTINS_FLOAT
-static void cbor_dump_double_big(mp_obj_t obj_data, vstr_t *data_vstr)
+static void cbor_dump_double_big(mp_obj_t obj_data, mp_cbor_writer_t *writer)
 {
-    vstr_add_byte(data_vstr, (byte)0xfb);
-    vstr_add_len(data_vstr, sizeof(uint64_t));
+    cbor_writer_add_byte(writer, (byte)0xfb);
 
-    byte *p = (byte *)data_vstr->buf + 1;
+    byte *p = cbor_writer_add_len(writer, sizeof(uint64_t));
 
     union
     {
@@ -531,12 +2327,11 @@ static void cbor_dump_double_big(mp_obj_t obj_data, vstr_t *data_vstr)
     mp_binary_set_int(sizeof(uint32_t), 1, p + sizeof(uint32_t), fp_dp.i32[0]);
 }
 
-static void cbor_dump_float_big(mp_obj_t obj_data, vstr_t *data_vstr)
+static void cbor_dump_float_big(mp_obj_t obj_data, mp_cbor_writer_t *writer)
 {
-    vstr_add_byte(data_vstr, (byte)0xfa);
-    vstr_add_len(data_vstr, sizeof(uint32_t));
+    cbor_writer_add_byte(writer, (byte)0xfa);
 
-    byte *p = (byte *)data_vstr->buf + 1;
+    byte *p = cbor_writer_add_len(writer, sizeof(uint32_t));
 
     union
     {
@@ -550,7 +2345,7 @@ static void cbor_dump_float_big(mp_obj_t obj_data, vstr_t *data_vstr)
     mp_binary_set_int(sizeof(uint32_t), 1, p, fp_sp.i32[0]);
 }
 
-static void cbor_dump_float(mp_obj_t obj_data, vstr_t *data_vstr)
+static void cbor_dump_float(mp_obj_t obj_data, mp_cbor_writer_t *writer)
 {
     union
     {
@@ -563,21 +2358,22 @@ static void cbor_dump_float(mp_obj_t obj_data, vstr_t *data_vstr)
     fp_dp.f = mp_obj_get_float_to_d(obj_data);
 
     /* Check if 'd' can represented as a normal half-float.
-     * Denormal half-floats could also be used, but that check
-     * isn't done now (denormal half-floats are decoded of course).
+     * Denormal half-floats are only used by the deterministic
+     * profile (denormal half-floats are decoded of course).
      * So just check exponent range and that at most 10 significant
      * bits (excluding implicit leading 1) are used in 'd'.
      */
     uint16_t u16 = (((uint16_t)fp_dp.i8[7]) << 8) | ((uint16_t)fp_dp.i8[6]);
     int16_t exp = (int16_t)((u16 & 0x7ff0U) >> 4) - 1023;
 
-    /* identity if d is +/- 0.0
+    /* identity if d is +/- 0.0, double denormals fall through
+     * to the full IEEE double below.
      */
-    if (exp == -1023)
+    if (exp == -1023 && fp_dp.f == 0.0)
     {
-        vstr_add_byte(data_vstr, (byte)0xf9);
-        vstr_add_byte(data_vstr, (byte)((signbit(fp_dp.f)) ? 0x80 : 00));
-        vstr_add_byte(data_vstr, (byte)0x00);
+        cbor_writer_add_byte(writer, (byte)0xf9);
+        cbor_writer_add_byte(writer, (byte)((signbit(fp_dp.f)) ? 0x80 : 00));
+        cbor_writer_add_byte(writer, (byte)0x00);
         return;
     }
 
@@ -599,17 +2395,34 @@ static void cbor_dump_float(mp_obj_t obj_data, vstr_t *data_vstr)
             t += ((uint16_t)fp_dp.i8[6] & 0x0fU) << 6;
             t += ((uint16_t)fp_dp.i8[5]) >> 2;
 
-            vstr_add_byte(data_vstr, (byte)0xf9);
-            vstr_add_len(data_vstr, sizeof(uint16_t));
+            cbor_writer_add_byte(writer, (byte)0xf9);
+            byte *p = cbor_writer_add_len(writer, sizeof(uint16_t));
+            mp_binary_set_int(sizeof(uint16_t), 1, p, t);
+            return;
+        }
+    }
+    else if (writer->deterministic && exp >= -24 && exp < -14)
+    {
+        /* Half-float denormal: the value is m * 2^-24 with m < 1024,
+         * so every mantissa bit below 2^-24 must be zero.
+         */
+        uint64_t mant = (fp_dp.i64[0] & 0xfffffffffffffULL) | (1ULL << 52);
+        int shift = 28 - exp;
+        if ((mant & ((1ULL << shift) - 1)) == 0)
+        {
+            uint16_t t = (uint16_t)((fp_dp.i64[0] >> 48) & 0x8000U) | (uint16_t)(mant >> shift);
 
-            byte *p = (byte *)data_vstr->buf + 1;
+            cbor_writer_add_byte(writer, (byte)0xf9);
+            byte *p = cbor_writer_add_len(writer, sizeof(uint16_t));
             mp_binary_set_int(sizeof(uint16_t), 1, p, t);
             return;
         }
     }
 
-    /* Same check for plain float.  Also no denormal support here. */
-    if (exp >= -126 && exp <= 127)
+    /* Same check for plain float, the deterministic profile also
+     * accepts float denormals (the cast check below covers them).
+     */
+    if (exp >= (writer->deterministic ? -149 : -126) && exp <= 127)
     {
         /* Float normal exponents (excl. denormals).
          *
@@ -625,7 +2438,7 @@ static void cbor_dump_float(mp_obj_t obj_data, vstr_t *data_vstr)
         float d_float = (float)fp_dp.f;
         if (((double)d_float == fp_dp.f))
         {
-            cbor_dump_float_big(obj_data, data_vstr);
+            cbor_dump_float_big(obj_data, writer);
             return;
         }
     }
@@ -637,110 +2450,198 @@ static void cbor_dump_float(mp_obj_t obj_data, vstr_t *data_vstr)
     {
         if (isnan(fp_dp.f))
         {
-            vstr_add_byte(data_vstr, (byte)0xf9);
-            vstr_add_byte(data_vstr, (byte)0x7e);
-            vstr_add_byte(data_vstr, (byte)0x00);
+            cbor_writer_add_byte(writer, (byte)0xf9);
+            cbor_writer_add_byte(writer, (byte)0x7e);
+            cbor_writer_add_byte(writer, (byte)0x00);
         }
         else if (isinf(fp_dp.f))
         {
-            vstr_add_byte(data_vstr, (byte)0xf9);
-            vstr_add_byte(data_vstr, (byte)(signbit(fp_dp.f) ? 0xfc : 0x7c));
-            vstr_add_byte(data_vstr, (byte)0x00);
+            cbor_writer_add_byte(writer, (byte)0xf9);
+            cbor_writer_add_byte(writer, (byte)(signbit(fp_dp.f) ? 0xfc : 0x7c));
+            cbor_writer_add_byte(writer, (byte)0x00);
         }
         return;
     }
 
     /* Cannot use half-float or float, encode as full IEEE double. */
-    cbor_dump_double_big(obj_data, data_vstr);
+    cbor_dump_double_big(obj_data, writer);
 }
 #endif
 
-static void cbor_dump_buffer_with_optional_major_type(mp_obj_t obj_data, vstr_t *data_vstr, mp_int_t mt)
+static void cbor_dump_buffer_with_major_type(mp_obj_t obj_data, mp_cbor_writer_t *writer, mp_int_t mt)
 {
     mp_buffer_info_t bufinfo;
     mp_get_buffer_raise(obj_data, &bufinfo, MP_BUFFER_READ);
-    if (mt != -1)
-    {
-        cbor_dump_int_with_major_type(mp_obj_new_int(bufinfo.len), data_vstr, mt);
-    }
-    vstr_add_strn(data_vstr, (const char *)bufinfo.buf, bufinfo.len);
+    cbor_dump_head(writer, mt, bufinfo.len);
+    cbor_writer_add_strn(writer, (const byte *)bufinfo.buf, bufinfo.len);
 }
 
-static void cbor_dump_buffer(mp_obj_t obj_data, vstr_t *data_vstr)
+static void cbor_dump_bool(mp_obj_t obj_data, mp_cbor_writer_t *writer)
 {
-    cbor_dump_buffer_with_optional_major_type(obj_data, data_vstr, -1);
+    cbor_writer_add_byte(writer, (byte)(mp_obj_is_true(obj_data) ? 0xf5 : 0xf4));
 }
 
-static void cbor_dump_bool(mp_obj_t obj_data, vstr_t *data_vstr)
+static void cbor_dump_none(mp_obj_t obj_data, mp_cbor_writer_t *writer)
 {
-    vstr_add_byte(data_vstr, (byte)(mp_obj_is_true(obj_data) ? 0xf5 : 0xf4));
+    cbor_writer_add_byte(writer, (byte)0xf6);
 }
 
-static void cbor_dump_none(mp_obj_t obj_data, vstr_t *data_vstr)
+static void cbor_dump_bytes(mp_obj_t obj_data, mp_cbor_writer_t *writer)
 {
-    vstr_add_byte(data_vstr, (byte)0xf6);
+    cbor_dump_buffer_with_major_type(obj_data, writer, 2);
 }
 
-static void cbor_dump_bytes(mp_obj_t obj_data, vstr_t *data_vstr)
+static void cbor_dump_text(mp_obj_t obj_data, mp_cbor_writer_t *writer)
 {
-    cbor_dump_buffer_with_optional_major_type(obj_data, data_vstr, 2);
+    cbor_dump_buffer_with_major_type(obj_data, writer, 3);
 }
 
-static void cbor_dump_text(mp_obj_t obj_data, vstr_t *data_vstr)
+static void cbor_dump_list(mp_obj_t obj_data, mp_cbor_writer_t *writer)
 {
-    cbor_dump_buffer_with_optional_major_type(obj_data, data_vstr, 3);
+    GET_ARRAY(obj_data);
+    cbor_dump_head(writer, 4, array_len);
+
+    for (size_t i = 0; i < array_len; i++)
+    {
+        cbor_dumps(array_items[i], writer);
+    }
 }
 
-static void cbor_dump_list(mp_obj_t obj_data, vstr_t *data_vstr)
+typedef struct _mp_cbor_map_entry_t
 {
-    GET_ARRAY(obj_data);
-    cbor_dump_int_with_major_type(mp_obj_new_int(array_len), data_vstr, 4);
+    size_t key;
+    size_t end;
+    mp_obj_t value;
+} mp_cbor_map_entry_t;
 
-    for (size_t i = 0; i < array_len; i++)
+// Bytewise lexicographic order of the encoded keys, RFC 8949 section 4.2.1.
+static int cbor_map_entry_cmp(const byte *buf, const mp_cbor_map_entry_t *a, const mp_cbor_map_entry_t *b)
+{
+    size_t a_len = a->end - a->key;
+    size_t b_len = b->end - b->key;
+    int cmp = memcmp(buf + a->key, buf + b->key, MIN(a_len, b_len));
+    if (cmp == 0)
     {
-        cbor_dumps(array_items[i], data_vstr);
+        cmp = (a_len > b_len) - (a_len < b_len);
     }
+    return cmp;
 }
 
-static void cbor_dump_dict(mp_obj_t obj_data, vstr_t *data_vstr)
+static void cbor_map_entries_sift_down(const byte *buf, mp_cbor_map_entry_t *entries, size_t root, size_t n)
 {
-    mp_map_t *map = mp_obj_dict_get_map(obj_data);
-    cbor_dump_int_with_major_type(mp_obj_new_int(map->used), data_vstr, 5);
+    for (;;)
+    {
+        size_t child = 2 * root + 1;
+        if (child >= n)
+        {
+            return;
+        }
+        if (child + 1 < n && cbor_map_entry_cmp(buf, &entries[child], &entries[child + 1]) < 0)
+        {
+            child++;
+        }
+        if (cbor_map_entry_cmp(buf, &entries[root], &entries[child]) >= 0)
+        {
+            return;
+        }
+        mp_cbor_map_entry_t tmp = entries[root];
+        entries[root] = entries[child];
+        entries[child] = tmp;
+        root = child;
+    }
+}
 
-#if defined(MICROPY_PY_UCBOR_CANONICAL)
-    mp_obj_t items = mp_obj_new_list(0, NULL);
+// In-place heapsort, no recursion and no allocation.
+static void cbor_map_entries_sort(const byte *buf, mp_cbor_map_entry_t *entries, size_t n)
+{
+    for (size_t i = n / 2; i-- > 0;)
+    {
+        cbor_map_entries_sift_down(buf, entries, i, n);
+    }
+    for (size_t i = n; i-- > 1;)
+    {
+        mp_cbor_map_entry_t tmp = entries[0];
+        entries[0] = entries[i];
+        entries[i] = tmp;
+        cbor_map_entries_sift_down(buf, entries, 0, i);
+    }
+}
+
+static void cbor_dump_dict_canonical(mp_map_t *map, mp_cbor_writer_t *writer)
+{
+    // only the keys go through the scratch buffer, values are written
+    // straight to the writer once the keys are sorted
+    VSTR_INIT(scratch_vstr, 16);
+    mp_cbor_writer_t scratch;
+    cbor_writer_init_vstr(&scratch, &scratch_vstr);
+    scratch.canonical = true;
+    scratch.deterministic = writer->deterministic;
+    scratch.default_func = writer->default_func;
+    size_t n_used = map->used;
+    mp_cbor_map_entry_t *entries = m_new(mp_cbor_map_entry_t, n_used);
+    size_t n_entries = 0;
     for (size_t i = 0; i < map->alloc; i++)
     {
         if (mp_map_slot_is_filled(map, i))
         {
-            mp_obj_t items_items[2] = {cbor_dumps(map->table[i].key, NULL), cbor_dumps(map->table[i].value, NULL)};
-            mp_obj_list_append(items, mp_obj_new_tuple(MP_ARRAY_SIZE(items_items), items_items));
+            // a default= hook may change the dict under us
+            if (n_entries == n_used)
+            {
+                mp_raise_msg(&mp_type_RuntimeError, MP_ERROR_TEXT("dict changed size during encoding"));
+            }
+            mp_cbor_map_entry_t *entry = &entries[n_entries++];
+            entry->value = map->table[i].value;
+            entry->key = scratch.len;
+            cbor_dumps(map->table[i].key, &scratch);
+            entry->end = scratch.len;
         }
     }
-    mp_obj_t items_kwargs = mp_obj_new_dict(0);
-    mp_obj_dict_store(items_kwargs, MP_ROM_QSTR(MP_QSTR_key), MP_OBJ_FROM_PTR(&cbor_sort_key_obj));
-    mp_obj_list_sort(1, &items, mp_obj_dict_get_map(items_kwargs));
+    if (n_entries != n_used)
+    {
+        mp_raise_msg(&mp_type_RuntimeError, MP_ERROR_TEXT("dict changed size during encoding"));
+    }
 
-    GET_ARRAY(items);
-    for (size_t i = 0; i < array_len; i++)
+    cbor_map_entries_sort(scratch.buf, entries, n_entries);
+    for (size_t i = 0; i < n_entries; i++)
     {
-        mp_obj_tuple_t *array_items_tuple = MP_OBJ_TO_PTR(array_items[i]);
-        cbor_dump_buffer(array_items_tuple->items[0], data_vstr);
-        cbor_dump_buffer(array_items_tuple->items[1], data_vstr);
+        cbor_writer_add_strn(writer, scratch.buf + entries[i].key, entries[i].end - entries[i].key);
+        cbor_dumps(entries[i].value, writer);
     }
-#else
+
+    m_del(mp_cbor_map_entry_t, entries, n_used);
+    vstr_clear(&scratch_vstr);
+}
+
+static void cbor_dump_dict(mp_obj_t obj_data, mp_cbor_writer_t *writer)
+{
+    mp_map_t *map = mp_obj_dict_get_map(obj_data);
+    size_t n_used = map->used;
+    cbor_dump_head(writer, 5, n_used);
+
+    // key order does not change the size, counting skips the sort
+    if (writer->canonical && !writer->count_only && n_used > 1)
+    {
+        cbor_dump_dict_canonical(map, writer);
+        return;
+    }
+    size_t n_entries = 0;
     for (size_t i = 0; i < map->alloc; i++)
     {
         if (mp_map_slot_is_filled(map, i))
         {
-            cbor_dumps(map->table[i].key, data_vstr);
-            cbor_dumps(map->table[i].value, data_vstr);
+            cbor_dumps(map->table[i].key, writer);
+            cbor_dumps(map->table[i].value, writer);
+            n_entries++;
         }
     }
-#endif
+    // the head is already written, a different count would be malformed
+    if (n_entries != n_used)
+    {
+        mp_raise_msg(&mp_type_RuntimeError, MP_ERROR_TEXT("dict changed size during encoding"));
+    }
 }
 
-static mp_cbor_dump_func_t dump_functions_map[] = {
+static const mp_cbor_dump_func_t dump_functions_map[] = {
     {&mp_type_int, cbor_dump_int},
 #if MICROPY_PY_BUILTINS_FLOAT
     {&mp_type_float, cbor_dump_float},
@@ -754,47 +2655,565 @@ static mp_cbor_dump_func_t dump_functions_map[] = {
     {&mp_type_list, cbor_dump_list},
     {&mp_type_tuple, cbor_dump_list},
     {&mp_type_dict, cbor_dump_dict},
+    {&cbor_tag_type, cbor_dump_tag},
+#if MICROPY_PY_ARRAY
+    {&mp_type_array, cbor_dump_typed_array},
+#endif
 };
 
-static mp_obj_t cbor_dumps(mp_obj_t obj_data, vstr_t *data_vstr)
+// Direct-mapped cache in front of dump_functions_map keyed on the type
+// pointer, so the table is only scanned the first time a type is seen.
+#define DUMP_FUNCTIONS_CACHE_SIZE (16)
+static const mp_cbor_dump_func_t *dump_functions_cache[DUMP_FUNCTIONS_CACHE_SIZE];
+
+static inline size_t cbor_dump_cache_slot(const mp_obj_type_t *type)
+{
+    uintptr_t h = (uintptr_t)type;
+    return (h ^ (h >> 4) ^ (h >> 8)) & (DUMP_FUNCTIONS_CACHE_SIZE - 1);
+}
+
+static void cbor_dumps(mp_obj_t obj_data, mp_cbor_writer_t *writer)
 {
+    MP_STACK_CHECK();
+
+    // immediate objects and singletons don't need a type lookup
+    if (mp_obj_is_small_int(obj_data))
+    {
+        cbor_dump_int(obj_data, writer);
+        return;
+    }
+    if (mp_obj_is_qstr(obj_data))
+    {
+        cbor_dump_text(obj_data, writer);
+        return;
+    }
+    if (obj_data == mp_const_none)
+    {
+        cbor_dump_none(obj_data, writer);
+        return;
+    }
+    if (obj_data == mp_const_false || obj_data == mp_const_true)
+    {
+        cbor_dump_bool(obj_data, writer);
+        return;
+    }
+
     const mp_obj_type_t *obj_data_type = mp_obj_get_type(obj_data);
-    bool need_temp_data_vstr = (data_vstr == NULL);
+    size_t slot = cbor_dump_cache_slot(obj_data_type);
+    const mp_cbor_dump_func_t *cached_dump_func = dump_functions_cache[slot];
+    if (cached_dump_func != NULL && cached_dump_func->_type == obj_data_type)
+    {
+        cached_dump_func->_func(obj_data, writer);
+        return;
+    }
 
     for (size_t i = 0; i < MP_ARRAY_SIZE(dump_functions_map); i++)
     {
-        mp_cbor_dump_func_t current_dump_func = dump_functions_map[i];
-        if (current_dump_func._type == obj_data_type)
+        const mp_cbor_dump_func_t *current_dump_func = &dump_functions_map[i];
+        if (current_dump_func->_type == obj_data_type)
         {
-            VSTR_INIT(temp_data_vstr, 16);
-            if (need_temp_data_vstr)
-            {
-                data_vstr = &temp_data_vstr;
-            }
-            current_dump_func._func(obj_data, data_vstr);
-            mp_obj_t val = mp_obj_new_bytes((byte *)data_vstr->buf, data_vstr->len);
-            if (need_temp_data_vstr)
-            {
-                vstr_clear(data_vstr);
-            }
-            return val;
+            dump_functions_cache[slot] = current_dump_func;
+            current_dump_func->_func(obj_data, writer);
+            return;
         }
     }
 
-    nlr_raise(mp_obj_new_exception_msg_varg(&mp_type_ValueError, MP_ERROR_TEXT("Unsupported value: %s"), mp_obj_get_type_str(obj_data)));
+    cbor_dump_unsupported(obj_data, writer);
+}
+
+// Default key ordering when an encoder isn't passed canonical=
+static bool cbor_canonical = MICROPY_PY_UCBOR_CANONICAL;
+
+static bool cbor_arg_canonical(mp_obj_t arg)
+{
+    return (arg == mp_const_none) ? cbor_canonical : mp_obj_is_true(arg);
+}
+
+// The deterministic profile (RFC 8949 section 4.2.1) implies sorted keys
+static void cbor_writer_set_profile(mp_cbor_writer_t *writer, mp_obj_t canonical, bool deterministic)
+{
+    writer->deterministic = deterministic;
+    writer->canonical = deterministic || cbor_arg_canonical(canonical);
+}
+
+static mp_obj_t cbor_encode(size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args)
+{
+    enum
+    {
+        ARG_obj,
+        ARG_canonical,
+        ARG_deterministic,
+        ARG_default
+    };
+    static const mp_arg_t allowed_args[] = {
+        {MP_QSTR_obj, MP_ARG_REQUIRED | MP_ARG_OBJ, {.u_obj = MP_OBJ_NULL}},
+        {MP_QSTR_canonical, MP_ARG_OBJ, {.u_rom_obj = MP_ROM_NONE}},
+        {MP_QSTR_deterministic, MP_ARG_BOOL, {.u_bool = false}},
+        {MP_QSTR_default, MP_ARG_OBJ, {.u_rom_obj = MP_ROM_NONE}},
+    };
+    mp_arg_val_t args[MP_ARRAY_SIZE(allowed_args)];
+    mp_arg_parse_all(n_args, pos_args, kw_args, MP_ARRAY_SIZE(allowed_args), allowed_args, args);
+
+    VSTR_INIT(data_vstr, 16);
+    mp_cbor_writer_t writer;
+    cbor_writer_init_vstr(&writer, &data_vstr);
+    cbor_writer_set_profile(&writer, args[ARG_canonical].u_obj, args[ARG_deterministic].u_bool);
+    writer.default_func = args[ARG_default].u_obj;
+    cbor_dumps(args[ARG_obj].u_obj, &writer);
+    return cbor_writer_finish_bytes(&writer);
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_KW(cbor_encode_obj, 1, cbor_encode);
+
+static mp_obj_t cbor_encode_into(size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args)
+{
+    enum
+    {
+        ARG_obj,
+        ARG_buf,
+        ARG_offset,
+        ARG_canonical,
+        ARG_deterministic,
+        ARG_default
+    };
+    static const mp_arg_t allowed_args[] = {
+        {MP_QSTR_obj, MP_ARG_REQUIRED | MP_ARG_OBJ, {.u_obj = MP_OBJ_NULL}},
+        {MP_QSTR_buf, MP_ARG_REQUIRED | MP_ARG_OBJ, {.u_obj = MP_OBJ_NULL}},
+        {MP_QSTR_offset, MP_ARG_INT, {.u_int = 0}},
+        {MP_QSTR_canonical, MP_ARG_OBJ, {.u_rom_obj = MP_ROM_NONE}},
+        {MP_QSTR_deterministic, MP_ARG_BOOL, {.u_bool = false}},
+        {MP_QSTR_default, MP_ARG_OBJ, {.u_rom_obj = MP_ROM_NONE}},
+    };
+    mp_arg_val_t args[MP_ARRAY_SIZE(allowed_args)];
+    mp_arg_parse_all(n_args, pos_args, kw_args, MP_ARRAY_SIZE(allowed_args), allowed_args, args);
+
+    mp_buffer_info_t bufinfo;
+    mp_get_buffer_raise(args[ARG_buf].u_obj, &bufinfo, MP_BUFFER_WRITE);
+    mp_int_t offset = args[ARG_offset].u_int;
+    if (offset < 0 || (size_t)offset > bufinfo.len)
+    {
+        mp_raise_ValueError(MP_ERROR_TEXT("Invalid offset"));
+    }
+    mp_cbor_writer_t writer;
+    cbor_writer_init_fixed(&writer, (byte *)bufinfo.buf + offset, bufinfo.len - offset);
+    writer.target = args[ARG_buf].u_obj;
+    writer.offset = offset;
+    cbor_writer_set_profile(&writer, args[ARG_canonical].u_obj, args[ARG_deterministic].u_bool);
+    writer.default_func = args[ARG_default].u_obj;
+    cbor_dumps(args[ARG_obj].u_obj, &writer);
+    return mp_obj_new_int_from_uint(writer.len);
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_KW(cbor_encode_into_obj, 2, cbor_encode_into);
+
+static mp_obj_t cbor_dump(size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args)
+{
+    enum
+    {
+        ARG_obj,
+        ARG_stream,
+        ARG_chunk,
+        ARG_canonical,
+        ARG_deterministic,
+        ARG_default
+    };
+    static const mp_arg_t allowed_args[] = {
+        {MP_QSTR_obj, MP_ARG_REQUIRED | MP_ARG_OBJ, {.u_obj = MP_OBJ_NULL}},
+        {MP_QSTR_stream, MP_ARG_REQUIRED | MP_ARG_OBJ, {.u_obj = MP_OBJ_NULL}},
+        {MP_QSTR_chunk, MP_ARG_INT, {.u_int = 256}},
+        {MP_QSTR_canonical, MP_ARG_OBJ, {.u_rom_obj = MP_ROM_NONE}},
+        {MP_QSTR_deterministic, MP_ARG_BOOL, {.u_bool = false}},
+        {MP_QSTR_default, MP_ARG_OBJ, {.u_rom_obj = MP_ROM_NONE}},
+    };
+    mp_arg_val_t args[MP_ARRAY_SIZE(allowed_args)];
+    mp_arg_parse_all(n_args, pos_args, kw_args, MP_ARRAY_SIZE(allowed_args), allowed_args, args);
+
+    // the chunk must hold the largest head or float written in one piece
+    if (args[ARG_chunk].u_int < 16)
+    {
+        mp_raise_ValueError(MP_ERROR_TEXT("Invalid chunk size"));
+    }
+
+    mp_cbor_writer_t writer;
+    cbor_writer_init_stream(&writer, args[ARG_stream].u_obj, args[ARG_chunk].u_int);
+    cbor_writer_set_profile(&writer, args[ARG_canonical].u_obj, args[ARG_deterministic].u_bool);
+    writer.default_func = args[ARG_default].u_obj;
+    cbor_dumps(args[ARG_obj].u_obj, &writer);
+    cbor_writer_flush(&writer);
+    m_del(byte, writer.buf, writer.alloc);
+    return mp_obj_new_int_from_uint(writer.written);
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_KW(cbor_dump_obj, 2, cbor_dump);
+
+static mp_obj_t cbor_encode_seq(size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args)
+{
+    enum
+    {
+        ARG_items,
+        ARG_stream,
+        ARG_chunk,
+        ARG_canonical,
+        ARG_deterministic,
+        ARG_default
+    };
+    static const mp_arg_t allowed_args[] = {
+        {MP_QSTR_items, MP_ARG_REQUIRED | MP_ARG_OBJ, {.u_obj = MP_OBJ_NULL}},
+        {MP_QSTR_stream, MP_ARG_OBJ, {.u_rom_obj = MP_ROM_NONE}},
+        {MP_QSTR_chunk, MP_ARG_INT, {.u_int = 256}},
+        {MP_QSTR_canonical, MP_ARG_OBJ, {.u_rom_obj = MP_ROM_NONE}},
+        {MP_QSTR_deterministic, MP_ARG_BOOL, {.u_bool = false}},
+        {MP_QSTR_default, MP_ARG_OBJ, {.u_rom_obj = MP_ROM_NONE}},
+    };
+    mp_arg_val_t args[MP_ARRAY_SIZE(allowed_args)];
+    mp_arg_parse_all(n_args, pos_args, kw_args, MP_ARRAY_SIZE(allowed_args), allowed_args, args);
+
+    // one writer for the whole sequence, into bytes or out to a stream
+    bool to_stream = args[ARG_stream].u_obj != mp_const_none;
+    vstr_t data_vstr;
+    mp_cbor_writer_t writer;
+    if (to_stream)
+    {
+        if (args[ARG_chunk].u_int < 16)
+        {
+            mp_raise_ValueError(MP_ERROR_TEXT("Invalid chunk size"));
+        }
+        cbor_writer_init_stream(&writer, args[ARG_stream].u_obj, args[ARG_chunk].u_int);
+    }
+    else
+    {
+        vstr_init(&data_vstr, 64);
+        cbor_writer_init_vstr(&writer, &data_vstr);
+    }
+    cbor_writer_set_profile(&writer, args[ARG_canonical].u_obj, args[ARG_deterministic].u_bool);
+    writer.default_func = args[ARG_default].u_obj;
+
+    mp_obj_iter_buf_t iter_buf;
+    mp_obj_t iterable = mp_getiter(args[ARG_items].u_obj, &iter_buf);
+    mp_obj_t item;
+    while ((item = mp_iternext(iterable)) != MP_OBJ_STOP_ITERATION)
+    {
+        cbor_dumps(item, &writer);
+    }
+
+    if (!to_stream)
+    {
+        return cbor_writer_finish_bytes(&writer);
+    }
+    cbor_writer_flush(&writer);
+    m_del(byte, writer.buf, writer.alloc);
+    return mp_obj_new_int_from_uint(writer.written);
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_KW(cbor_encode_seq_obj, 1, cbor_encode_seq);
+
+static mp_obj_t cbor_set_canonical(mp_obj_t flag)
+{
+    cbor_canonical = mp_obj_is_true(flag);
+    return mp_const_none;
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_1(cbor_set_canonical_obj, cbor_set_canonical);
+
+#if MICROPY_MODULE_BUILTIN_INIT
+// Runs on the first import after every (soft) reset, so a set_canonical()
+// from a previous session doesn't leak into the next one
+static mp_obj_t cbor___init__(void)
+{
+    cbor_canonical = MICROPY_PY_UCBOR_CANONICAL;
+    return mp_const_none;
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_0(cbor___init___obj, cbor___init__);
+#endif
+
+static mp_obj_t cbor_encoded_size(size_t n_args, const mp_obj_t *pos_args, mp_map_t *kw_args)
+{
+    enum
+    {
+        ARG_obj,
+        ARG_canonical,
+        ARG_deterministic,
+        ARG_default
+    };
+    static const mp_arg_t allowed_args[] = {
+        {MP_QSTR_obj, MP_ARG_REQUIRED | MP_ARG_OBJ, {.u_obj = MP_OBJ_NULL}},
+        {MP_QSTR_canonical, MP_ARG_OBJ, {.u_rom_obj = MP_ROM_NONE}},
+        {MP_QSTR_deterministic, MP_ARG_BOOL, {.u_bool = false}},
+        {MP_QSTR_default, MP_ARG_OBJ, {.u_rom_obj = MP_ROM_NONE}},
+    };
+    mp_arg_val_t args[MP_ARRAY_SIZE(allowed_args)];
+    mp_arg_parse_all(n_args, pos_args, kw_args, MP_ARRAY_SIZE(allowed_args), allowed_args, args);
+
+    byte scratch[16];
+    mp_cbor_writer_t writer;
+    cbor_writer_init_count(&writer, scratch, sizeof(scratch));
+    // The deterministic profile shrinks floats, so it changes the size
+    cbor_writer_set_profile(&writer, args[ARG_canonical].u_obj, args[ARG_deterministic].u_bool);
+    writer.default_func = args[ARG_default].u_obj;
+    cbor_dumps(args[ARG_obj].u_obj, &writer);
+    return mp_obj_new_int_from_uint(writer.written + writer.len);
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_KW(cbor_encoded_size_obj, 1, cbor_encoded_size);
+
+// Open container in the Encoder, 'odd' tracks whether a map is waiting
+// for the value of its last key
+typedef struct _mp_cbor_encoder_frame_t
+{
+    bool is_map;
+    bool odd;
+} mp_cbor_encoder_frame_t;
+
+typedef struct _mp_obj_cbor_encoder_t
+{
+    mp_obj_base_t base;
+    mp_cbor_writer_t writer;
+    size_t depth;
+    size_t stack_alloc;
+    mp_cbor_encoder_frame_t *stack;
+    bool failed;
+    // set while an operation runs, see cbor_encoder_run()
+    bool busy;
+} mp_obj_cbor_encoder_t;
+
+static mp_obj_t cbor_encoder_make_new(const mp_obj_type_t *type, size_t n_args, size_t n_kw, const mp_obj_t *args)
+{
+    enum
+    {
+        ARG_stream,
+        ARG_chunk,
+        ARG_canonical,
+        ARG_default
+    };
+    static const mp_arg_t allowed_args[] = {
+        {MP_QSTR_stream, MP_ARG_REQUIRED | MP_ARG_OBJ, {.u_obj = MP_OBJ_NULL}},
+        {MP_QSTR_chunk, MP_ARG_INT, {.u_int = 256}},
+        {MP_QSTR_canonical, MP_ARG_OBJ, {.u_rom_obj = MP_ROM_NONE}},
+        {MP_QSTR_default, MP_ARG_OBJ, {.u_rom_obj = MP_ROM_NONE}},
+    };
+    mp_arg_val_t parsed[MP_ARRAY_SIZE(allowed_args)];
+    mp_arg_parse_all_kw_array(n_args, n_kw, args, MP_ARRAY_SIZE(allowed_args), allowed_args, parsed);
+
+    if (parsed[ARG_chunk].u_int < 16)
+    {
+        mp_raise_ValueError(MP_ERROR_TEXT("Invalid chunk size"));
+    }
+
+    // indefinite lengths rule out the deterministic profile
+    mp_obj_cbor_encoder_t *self = mp_obj_malloc(mp_obj_cbor_encoder_t, type);
+    cbor_writer_init_stream(&self->writer, parsed[ARG_stream].u_obj, parsed[ARG_chunk].u_int);
+    cbor_writer_set_profile(&self->writer, parsed[ARG_canonical].u_obj, false);
+    self->writer.default_func = parsed[ARG_default].u_obj;
+    self->depth = 0;
+    self->stack_alloc = 4;
+    self->stack = m_new(mp_cbor_encoder_frame_t, self->stack_alloc);
+    self->failed = false;
+    self->busy = false;
+    return MP_OBJ_FROM_PTR(self);
+}
+
+typedef void (*mp_cbor_encoder_op_t)(mp_obj_cbor_encoder_t *self, mp_obj_t arg);
+
+// Run one Encoder operation. Both default= and the stream are Python code
+// that could call back into the Encoder while an item is half written.
+static mp_obj_cbor_encoder_t *cbor_encoder_run(mp_obj_t self_in, mp_cbor_encoder_op_t op, mp_obj_t arg)
+{
+    mp_obj_cbor_encoder_t *self = MP_OBJ_TO_PTR(self_in);
+    if (self->failed)
+    {
+        mp_raise_ValueError(MP_ERROR_TEXT("Encoder failed"));
+    }
+    if (self->busy)
+    {
+        mp_raise_msg(&mp_type_RuntimeError, MP_ERROR_TEXT("Encoder is busy"));
+    }
+    self->busy = true;
+    nlr_buf_t nlr;
+    if (nlr_push(&nlr) == 0)
+    {
+        op(self, arg);
+        nlr_pop();
+        self->busy = false;
+    }
+    else
+    {
+        self->busy = false;
+        nlr_jump(nlr.ret_val);
+    }
+    return self;
+}
+
+// Count one more item in the open container; a finished top-level item
+// goes out to the stream right away
+static void cbor_encoder_item_done(mp_obj_cbor_encoder_t *self)
+{
+    if (self->depth == 0)
+    {
+        cbor_writer_flush(&self->writer);
+    }
+    else
+    {
+        self->stack[self->depth - 1].odd ^= true;
+    }
+}
+
+static void cbor_encoder_write_op(mp_obj_cbor_encoder_t *self, mp_obj_t obj_data)
+{
+    size_t len = self->writer.len;
+    size_t written = self->writer.written;
+    nlr_buf_t nlr;
+    if (nlr_push(&nlr) == 0)
+    {
+        cbor_dumps(obj_data, &self->writer);
+        nlr_pop();
+    }
+    else
+    {
+        // flushes drop the bytes they sent from the front of the buffer
+        size_t sent = self->writer.written - written;
+        if (sent <= len)
+        {
+            // only earlier items reached the stream, drop the partial one
+            self->writer.len = len - sent;
+        }
+        else
+        {
+            // part of the item is already out, the document can't be completed
+            self->failed = true;
+        }
+        nlr_jump(nlr.ret_val);
+    }
+    // the item is accepted, if the flush fails it stays buffered for the next one
+    cbor_encoder_item_done(self);
+}
+
+static mp_obj_t cbor_encoder_write(mp_obj_t self_in, mp_obj_t obj_data)
+{
+    cbor_encoder_run(self_in, cbor_encoder_write_op, obj_data);
+    return mp_const_none;
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_2(cbor_encoder_write_obj, cbor_encoder_write);
+
+static void cbor_encoder_begin_op(mp_obj_cbor_encoder_t *self, mp_obj_t mt_in)
+{
+    byte mt = MP_OBJ_SMALL_INT_VALUE(mt_in);
+    cbor_writer_add_byte(&self->writer, (byte)((mt << 5) | CBOR_AI_INDEFINITE));
+    // the new container is itself an item of its parent
+    if (self->depth > 0)
+    {
+        self->stack[self->depth - 1].odd ^= true;
+    }
+    if (self->depth == self->stack_alloc)
+    {
+        self->stack = m_renew(mp_cbor_encoder_frame_t, self->stack, self->stack_alloc, self->stack_alloc * 2);
+        self->stack_alloc *= 2;
+    }
+    mp_cbor_encoder_frame_t *frame = &self->stack[self->depth++];
+    frame->is_map = (mt == 5);
+    frame->odd = false;
+}
+
+static mp_obj_t cbor_encoder_begin_array(mp_obj_t self_in)
+{
+    cbor_encoder_run(self_in, cbor_encoder_begin_op, MP_OBJ_NEW_SMALL_INT(4));
+    return mp_const_none;
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_1(cbor_encoder_begin_array_obj, cbor_encoder_begin_array);
+
+static mp_obj_t cbor_encoder_begin_map(mp_obj_t self_in)
+{
+    cbor_encoder_run(self_in, cbor_encoder_begin_op, MP_OBJ_NEW_SMALL_INT(5));
+    return mp_const_none;
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_1(cbor_encoder_begin_map_obj, cbor_encoder_begin_map);
+
+static void cbor_encoder_end_op(mp_obj_cbor_encoder_t *self, mp_obj_t arg)
+{
+    if (self->depth == 0)
+    {
+        mp_raise_ValueError(MP_ERROR_TEXT("No open container"));
+    }
+    // leave the map open so the caller can still write the missing value
+    mp_cbor_encoder_frame_t *frame = &self->stack[self->depth - 1];
+    if (frame->is_map && frame->odd)
+    {
+        mp_raise_ValueError(MP_ERROR_TEXT("Map key without value"));
+    }
+    cbor_writer_add_byte(&self->writer, CBOR_BREAK);
+    self->depth--;
+    if (self->depth == 0)
+    {
+        cbor_writer_flush(&self->writer);
+    }
+}
+
+static mp_obj_t cbor_encoder_end(mp_obj_t self_in)
+{
+    cbor_encoder_run(self_in, cbor_encoder_end_op, mp_const_none);
+    return mp_const_none;
+}
+
+static MP_DEFINE_CONST_FUN_OBJ_1(cbor_encoder_end_obj, cbor_encoder_end);
+
+static void cbor_encoder_flush_op(mp_obj_cbor_encoder_t *self, mp_obj_t arg)
+{
+    cbor_writer_flush(&self->writer);
 }
 
-static mp_obj_t cbor_encode(mp_obj_t obj_data)
+static mp_obj_t cbor_encoder_flush(mp_obj_t self_in)
 {
-    return cbor_dumps(obj_data, NULL);
+    mp_obj_cbor_encoder_t *self = cbor_encoder_run(self_in, cbor_encoder_flush_op, mp_const_none);
+    return mp_obj_new_int_from_uint(self->writer.written);
 }
 
-static MP_DEFINE_CONST_FUN_OBJ_1(cbor_encode_obj, cbor_encode);
+static MP_DEFINE_CONST_FUN_OBJ_1(cbor_encoder_flush_obj, cbor_encoder_flush);
+
+static const mp_rom_map_elem_t cbor_encoder_locals_dict_table[] = {
+    {MP_ROM_QSTR(MP_QSTR_write), MP_ROM_PTR(&cbor_encoder_write_obj)},
+    {MP_ROM_QSTR(MP_QSTR_begin_array), MP_ROM_PTR(&cbor_encoder_begin_array_obj)},
+    {MP_ROM_QSTR(MP_QSTR_begin_map), MP_ROM_PTR(&cbor_encoder_begin_map_obj)},
+    {MP_ROM_QSTR(MP_QSTR_end), MP_ROM_PTR(&cbor_encoder_end_obj)},
+    {MP_ROM_QSTR(MP_QSTR_flush), MP_ROM_PTR(&cbor_encoder_flush_obj)},
+};
+
+static MP_DEFINE_CONST_DICT(cbor_encoder_locals_dict, cbor_encoder_locals_dict_table);
+
+static MP_DEFINE_CONST_OBJ_TYPE(
+    cbor_encoder_type,
+    MP_QSTR_Encoder,
+    MP_TYPE_FLAG_NONE,
+    make_new, cbor_encoder_make_new,
+    locals_dict, &cbor_encoder_locals_dict);
 
 static const mp_rom_map_elem_t mp_module_ucbor_globals_table[] = {
     {MP_ROM_QSTR(MP_QSTR___name__), MP_ROM_QSTR(MP_QSTR__cbor)},
+#if MICROPY_MODULE_BUILTIN_INIT
+    {MP_ROM_QSTR(MP_QSTR___init__), MP_ROM_PTR(&cbor___init___obj)},
+#endif
     {MP_ROM_QSTR(MP_QSTR_decode), MP_ROM_PTR(&cbor_decode_obj)},
+    {MP_ROM_QSTR(MP_QSTR_decode_seq), MP_ROM_PTR(&cbor_decode_seq_obj)},
+    {MP_ROM_QSTR(MP_QSTR_decode_lazy), MP_ROM_PTR(&cbor_decode_lazy_obj)},
+    {MP_ROM_QSTR(MP_QSTR_item_span), MP_ROM_PTR(&cbor_item_span_obj)},
+    {MP_ROM_QSTR(MP_QSTR_get), MP_ROM_PTR(&cbor_get_obj)},
+    {MP_ROM_QSTR(MP_QSTR_get_many), MP_ROM_PTR(&cbor_get_many_obj)},
+    {MP_ROM_QSTR(MP_QSTR_iter_decode), MP_ROM_PTR(&cbor_iter_decode_obj)},
+    {MP_ROM_QSTR(MP_QSTR_dump), MP_ROM_PTR(&cbor_dump_obj)},
+    {MP_ROM_QSTR(MP_QSTR_load), MP_ROM_PTR(&cbor_load_obj)},
+    {MP_ROM_QSTR(MP_QSTR_set_canonical), MP_ROM_PTR(&cbor_set_canonical_obj)},
     {MP_ROM_QSTR(MP_QSTR_encode), MP_ROM_PTR(&cbor_encode_obj)},
+    {MP_ROM_QSTR(MP_QSTR_encode_into), MP_ROM_PTR(&cbor_encode_into_obj)},
+    {MP_ROM_QSTR(MP_QSTR_encode_seq), MP_ROM_PTR(&cbor_encode_seq_obj)},
+    {MP_ROM_QSTR(MP_QSTR_encoded_size), MP_ROM_PTR(&cbor_encoded_size_obj)},
+    {MP_ROM_QSTR(MP_QSTR_is_deterministic), MP_ROM_PTR(&cbor_is_deterministic_obj)},
+    {MP_ROM_QSTR(MP_QSTR_Decoder), MP_ROM_PTR(&cbor_decoder_type)},
+    {MP_ROM_QSTR(MP_QSTR_Encoder), MP_ROM_PTR(&cbor_encoder_type)},
+    {MP_ROM_QSTR(MP_QSTR_CBORTag), MP_ROM_PTR(&cbor_tag_type)},
+    {MP_ROM_QSTR(MP_QSTR_CBORArrayView), MP_ROM_PTR(&cbor_array_view_type)},
+    {MP_ROM_QSTR(MP_QSTR_CBORMapView), MP_ROM_PTR(&cbor_map_view_type)},
 };
 
 static MP_DEFINE_CONST_DICT(mp_module_ucbor_globals, mp_module_ucbor_globals_table);
@@ -0,0 +1,37 @@
+# -*- coding: utf-8 -*-
+# pylint:disable=unresolved-import
+import gc
+import cbor
+
+import utime
+
+
+def bench(name, func, arg, rounds=10):
+    gc.collect()
+    t0 = utime.ticks_us()
+    for _ in range(rounds):
+        func(arg)
+    t1 = utime.ticks_us()
+    print(f"{name}: {utime.ticks_diff(t1, t0) / rounds:.2f} us")
+
+
+def documents():
+    record = {
+        "id": 1234,
+        "name": "sensor",
+        "ok": True,
+        "value": 21.5,
+        "raw": b"\x01\x02\x03\x04",
+        "tags": ["a", "b", None],
+    }
+    return (
+        ("ints", list(range(1000))),
+        ("records", [record] * 200),
+        ("nested", [[[[i, (i, i), {"k": i}] for i in range(10)]] for _ in range(50)]),
+    )
+
+
+if __name__ == "__main__":
+    for name, document in documents():
+        bench(f"encode {name}", cbor.encode, document)
+        bench(f"decode {name}", cbor.decode, cbor.encode(document))